@@ -1,271 +1,7272 @@
-#include <wx/wx.h>
-#include <vector>
-#include <cstdlib> // For random color
-
-// Base class for shapes
-class Shape {
-public:
-    virtual void Draw(wxDC& dc) = 0; // Pure virtual function for drawing
-    virtual ~Shape() {}
-    virtual void SetColor(const wxColor& color) = 0; // Set color for the shape
-};
-
-// Circle class (static, no pulsing)
-class Circle : public Shape {
-private:
-    wxPoint center;
-    int radius;
-    wxColor color;
-
-public:
-    Circle(const wxPoint& center, int radius, const wxColor& color)
-        : center(center), radius(radius), color(color) {}
-
-    void Draw(wxDC& dc) override {
-        dc.SetBrush(wxBrush(color));
-        dc.DrawCircle(center, radius);
-    }
-
-    void SetColor(const wxColor& color) override {
-        this->color = color;
-    }
-};
-
-// Square class
-class Square : public Shape {
-private:
-    wxPoint topLeft;
-    int sideLength;
-    wxColor color;
-
-public:
-    Square(const wxPoint& topLeft, int sideLength, const wxColor& color)
-        : topLeft(topLeft), sideLength(sideLength), color(color) {}
-
-    void Draw(wxDC& dc) override {
-        dc.SetBrush(wxBrush(color));
-        dc.DrawRectangle(topLeft, wxSize(sideLength, sideLength));
-    }
-
-    void SetColor(const wxColor& color) override {
-        this->color = color;
-    }
-};
-
-// Freehand line class
-class FreehandLine : public Shape {
-private:
-    std::vector<wxPoint> points;
-    wxColor color;
-    bool rainbowMode; // Enable rainbow mode for dynamic color changes
-
-public:
-    FreehandLine(const wxColor& color, bool rainbowMode = false) : color(color), rainbowMode(rainbowMode) {}
-
-    void AddPoint(const wxPoint& point) {
-        points.push_back(point);
-    }
-
-    void Draw(wxDC& dc) override {
-        dc.SetPen(wxPen(color, 2)); // Set the pen color and width
-        if (points.size() > 1) {
-            dc.DrawLines(points.size(), points.data());
-        }
-    }
-
-    void SetColor(const wxColor& color) override {
-        this->color = color;
-    }
-
-    // Dynamically change color in rainbow mode
-    void UpdateRainbowColor() {
-        if (rainbowMode) {
-            color = wxColor(rand() % 256, rand() % 256, rand() % 256); // Random RGB values
-        }
-    }
-};
-
-// Canvas class
-class PaintCanvas : public wxPanel {
-private:
-    std::vector<Shape*> shapes;
-    FreehandLine* currentLine = nullptr;
-    Circle* currentCircle = nullptr;
-    Square* currentSquare = nullptr;
-    wxColor currentColor;
-    bool rainbowMode = false;
-    bool eraserMode = false;
-    bool circleMode = false;  // Mode for drawing circles
-    bool squareMode = false;  // Mode for drawing squares
-    int shapeSize = 50;       // Default size for circles and squares
-
-public:
-    PaintCanvas(wxWindow* parent) : wxPanel(parent) {
-        currentColor = *wxBLACK; // Default color
-
-        Bind(wxEVT_PAINT, &PaintCanvas::OnPaint, this);
-        Bind(wxEVT_LEFT_DOWN, &PaintCanvas::OnLeftDown, this);
-        Bind(wxEVT_LEFT_UP, &PaintCanvas::OnLeftUp, this);
-        Bind(wxEVT_MOTION, &PaintCanvas::OnMouseMove, this);
-    }
-
-    ~PaintCanvas() {
-        for (Shape* shape : shapes) {
-            delete shape; // Clean up allocated memory
-        }
-        delete currentLine;
-        delete currentCircle;
-        delete currentSquare;
-    }
-
-    void OnPaint(wxPaintEvent& event) {
-        wxPaintDC dc(this);
-        for (Shape* shape : shapes) {
-            shape->Draw(dc);
-        }
-        if (currentLine) {
-            currentLine->Draw(dc); // Draw the current freehand line
-        }
-        if (currentCircle) {
-            currentCircle->Draw(dc); // Draw the current circle
-        }
-        if (currentSquare) {
-            currentSquare->Draw(dc); // Draw the current square
-        }
-    }
-
-    void OnLeftDown(wxMouseEvent& event) {
-        if (circleMode) {
-            // Create a new circle at the clicked position with a fixed radius
-            currentCircle = new Circle(event.GetPosition(), shapeSize, currentColor);
-            shapes.push_back(currentCircle);
-            currentCircle = nullptr; // Reset the current circle
-            Refresh();
-        }
-        else if (squareMode) {
-            // Create a new square at the clicked position with a fixed size
-            currentSquare = new Square(event.GetPosition(), shapeSize, currentColor);
-            shapes.push_back(currentSquare);
-            currentSquare = nullptr; // Reset the current square
-            Refresh();
-        }
-        else if (eraserMode) {
-            currentLine = new FreehandLine(*wxWHITE); // Eraser draws with white color
-        }
-        else {
-            currentLine = new FreehandLine(currentColor, rainbowMode);
-        }
-        if (currentLine) {
-            currentLine->AddPoint(event.GetPosition());
-        }
-        Refresh();
-    }
-
-    void OnLeftUp(wxMouseEvent& event) {
-        if (currentLine) {
-            currentLine->AddPoint(event.GetPosition());
-            shapes.push_back(currentLine); // Save the line to shapes
-            currentLine = nullptr; // Reset current line
-        }
-        Refresh();
-    }
-
-    void OnMouseMove(wxMouseEvent& event) {
-        if (currentLine) {
-            if (rainbowMode) {
-                currentLine->UpdateRainbowColor(); // Update rainbow color during drawing
-            }
-            currentLine->AddPoint(event.GetPosition());
-            Refresh(); // Update drawing while dragging
-        }
-    }
-
-    void SetColor(const wxColor& color) {
-        currentColor = color;
-        eraserMode = false; // Disable eraser mode when color is set
-        rainbowMode = false; // Disable rainbow mode when a specific color is set
-        circleMode = false;  // Disable circle mode when a specific color is set
-        squareMode = false;  // Disable square mode when a specific color is set
-    }
-
-    void EnableRainbowMode() {
-        rainbowMode = true;
-        circleMode = false;  // Disable circle mode when rainbow is enabled
-        squareMode = false;  // Disable square mode when rainbow is enabled
-    }
-
-    void EnableEraserMode() {
-        eraserMode = true;
-        circleMode = false;  // Disable circle mode when eraser is enabled
-        squareMode = false;  // Disable square mode when eraser is enabled
-    }
-
-    void EnableCircleMode() {
-        circleMode = true;   // Enable circle mode
-        eraserMode = false;  // Disable other modes
-        rainbowMode = false;
-        squareMode = false;  // Disable square mode when circle is enabled
-    }
-
-    void EnableSquareMode() {
-        squareMode = true;   // Enable square mode
-        eraserMode = false;  // Disable other modes
-        rainbowMode = false;
-        circleMode = false;  // Disable circle mode when square is enabled
-    }
-};
-
-// Application class
-class MyApp : public wxApp {
-public:
-    virtual bool OnInit();
-};
-
-// Custom IDs for color, shape, and modes
-const int ID_COLOR_RED = wxID_HIGHEST + 1;
-const int ID_COLOR_GREEN = wxID_HIGHEST + 2;
-const int ID_COLOR_BLUE = wxID_HIGHEST + 3;
-const int ID_MODE_RAINBOW = wxID_HIGHEST + 4;
-const int ID_MODE_ERASER = wxID_HIGHEST + 5;
-const int ID_MODE_CIRCLE = wxID_HIGHEST + 6;
-const int ID_MODE_SQUARE = wxID_HIGHEST + 7; // New menu ID for square mode
-
-wxIMPLEMENT_APP(MyApp);
-
-bool MyApp::OnInit() {
-    wxFrame* frame = new wxFrame(nullptr, wxID_ANY, "Interactive Paint App", wxDefaultPosition, wxSize(800, 600));
-    PaintCanvas* canvas = new PaintCanvas(frame);
-
-    wxMenuBar* menuBar = new wxMenuBar;
-
-    // Color menu
-    wxMenu* colorMenu = new wxMenu;
-    colorMenu->Append(ID_COLOR_RED, "Red");
-    colorMenu->Append(ID_COLOR_GREEN, "Green");
-    colorMenu->Append(ID_COLOR_BLUE, "Blue");
-    menuBar->Append(colorMenu, "Colors");
-
-    // Fun modes menu
-    wxMenu* modeMenu = new wxMenu;
-    modeMenu->Append(ID_MODE_RAINBOW, "Rainbow Brush");
-    modeMenu->Append(ID_MODE_ERASER, "Eraser");
-    modeMenu->Append(ID_MODE_CIRCLE, "Draw Circle");
-    modeMenu->Append(ID_MODE_SQUARE, "Draw Square");  // New menu option for square mode
-    menuBar->Append(modeMenu, "Fun Modes");
-
-    frame->SetMenuBar(menuBar);
-
-    // Bind color selection events
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->SetColor(*wxRED); }, ID_COLOR_RED);
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->SetColor(*wxGREEN); }, ID_COLOR_GREEN);
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->SetColor(*wxBLUE); }, ID_COLOR_BLUE);
-
-    // Bind mode selection events
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->EnableRainbowMode(); }, ID_MODE_RAINBOW);
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->EnableEraserMode(); }, ID_MODE_ERASER);
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->EnableCircleMode(); }, ID_MODE_CIRCLE);
-    frame->Bind(wxEVT_MENU, [canvas](wxCommandEvent&) { canvas->EnableSquareMode(); }, ID_MODE_SQUARE);  // Square mode binding
-
-    frame->Show();
-    return true;
-}
+#include <wx/wx.h>
+#include <wx/clipbrd.h>
+#include <wx/dcgraph.h>
+#include <wx/dcsvg.h>
+#include <wx/dir.h>
+#include <wx/dirdlg.h>
+#include <wx/filename.h>
+#include <wx/graphics.h>
+#include <wx/notebook.h>
+#include <wx/stdpaths.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <vector>
+#include <cstdlib> // For random color
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+// Pens and brushes come from wx's shared lists so drawing a shape never allocates GDI objects
+inline void UseFillStyle(wxDC& dc, const wxColor& color) {
+    dc.SetPen(*wxBLACK_PEN);
+    dc.SetBrush(*wxTheBrushList->FindOrCreateBrush(color));
+}
+
+inline void UseStrokeStyle(wxDC& dc, const wxColor& color, int width) {
+    dc.SetPen(*wxThePenList->FindOrCreatePen(color, width));
+}
+
+// Hit and eviction counters shared by all glyph atlases
+struct GlyphCacheStats {
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+};
+
+// Glyphs of one font and colour, rasterized once into alpha-blended pages and then blitted
+class GlyphAtlas {
+public:
+    enum { pageSize = 256 };
+
+    struct Glyph {
+        int page = -1;   // -1 when there is nothing to draw (spaces)
+        wxRect rect;     // Location inside the page
+        int advance = 0; // Horizontal distance to the next glyph
+    };
+
+    GlyphAtlas(const wxFont& font, const wxColor& color) : font(font), color(color) {
+        wxBitmap probe(1, 1);
+        wxMemoryDC probeDC(probe);
+        probeDC.SetFont(font);
+        int width = 0;
+        probeDC.GetTextExtent("Hg", &width, &lineHeight);
+    }
+
+    // Look up a glyph, rasterizing it into a page the first time it is used
+    const Glyph& GetGlyph(wxUniChar ch, GlyphCacheStats& stats) {
+        auto found = glyphs.find(ch.GetValue());
+        if (found != glyphs.end()) {
+            ++stats.hits;
+            return found->second;
+        }
+        ++stats.misses;
+        return glyphs[ch.GetValue()] = Rasterize(ch);
+    }
+
+    wxSize MeasureText(const wxString& text, GlyphCacheStats& stats) {
+        int width = 0;
+        for (wxUniChar ch : text) {
+            width += GetGlyph(ch, stats).advance;
+        }
+        return wxSize(width, lineHeight);
+    }
+
+    void DrawText(wxDC& dc, const wxString& text, const wxPoint& at, GlyphCacheStats& stats) {
+        std::vector<const Glyph*> run;
+        run.reserve(text.length());
+        for (wxUniChar ch : text) {
+            run.push_back(&GetGlyph(ch, stats));
+        }
+        for (Page& page : pages) {
+            if (page.dirty) {
+                page.bitmap = wxBitmap(page.image); // Upload new glyphs once per draw, not per glyph
+                page.dirty = false;
+            }
+        }
+        wxMemoryDC pageDC;
+        int selectedPage = -1;
+        int x = at.x;
+        for (const Glyph* glyph : run) {
+            if (glyph->page >= 0) {
+                if (glyph->page != selectedPage) {
+                    selectedPage = glyph->page;
+                    pageDC.SelectObjectAsSource(pages[selectedPage].bitmap);
+                }
+                dc.Blit(x, at.y, glyph->rect.width, glyph->rect.height, &pageDC, glyph->rect.x, glyph->rect.y);
+            }
+            x += glyph->advance;
+        }
+    }
+
+    // Page image plus its bitmap copy
+    size_t GetMemoryBytes() const {
+        return pages.size() * pageSize * pageSize * 8;
+    }
+
+private:
+    struct Page {
+        wxImage image; // Text colour with per-pixel glyph coverage as alpha
+        wxBitmap bitmap;
+        bool dirty = true;
+    };
+
+    wxFont font;
+    wxColor color;
+    int lineHeight = 0;
+    std::unordered_map<unsigned, Glyph> glyphs;
+    std::vector<Page> pages;
+    int cursorX = 0; // Next free slot in the last page, filled row by row
+    int cursorY = 0;
+    int rowHeight = 0;
+
+    void AddPage() {
+        Page page;
+        page.image.Create(pageSize, pageSize, false);
+        unsigned char* rgb = page.image.GetData();
+        for (int i = 0; i < pageSize * pageSize; ++i) {
+            rgb[i * 3] = color.Red();
+            rgb[i * 3 + 1] = color.Green();
+            rgb[i * 3 + 2] = color.Blue();
+        }
+        page.image.InitAlpha();
+        std::fill(page.image.GetAlpha(), page.image.GetAlpha() + pageSize * pageSize, 0);
+        pages.push_back(page);
+        cursorX = cursorY = rowHeight = 0;
+    }
+
+    Glyph Rasterize(wxUniChar ch) {
+        wxString glyphText(ch);
+        Glyph glyph;
+        wxBitmap scratch(1, 1);
+        wxMemoryDC scratchDC(scratch);
+        scratchDC.SetFont(font);
+        int width = 0, height = 0;
+        scratchDC.GetTextExtent(glyphText, &width, &height);
+        glyph.advance = width;
+        if (width <= 0 || height <= 0 || ch.GetValue() == ' ') {
+            return glyph;
+        }
+        width = std::min<int>(width, pageSize);
+        height = std::min<int>(height, pageSize);
+
+        // Find room in the current row, the next row or a fresh page
+        if (!pages.empty() && cursorX + width > pageSize) {
+            cursorX = 0;
+            cursorY += rowHeight;
+            rowHeight = 0;
+        }
+        if (pages.empty() || cursorY + height > pageSize) {
+            AddPage();
+        }
+        glyph.page = static_cast<int>(pages.size()) - 1;
+        glyph.rect = wxRect(cursorX, cursorY, width, height);
+        cursorX += width;
+        rowHeight = std::max(rowHeight, height);
+
+        // White on black gives the coverage, which becomes the page alpha
+        scratchDC.SelectObject(wxNullBitmap);
+        scratch.Create(width, height);
+        scratchDC.SelectObject(scratch);
+        scratchDC.SetBackground(*wxBLACK_BRUSH);
+        scratchDC.Clear();
+        scratchDC.SetTextForeground(*wxWHITE);
+        scratchDC.DrawText(glyphText, 0, 0);
+        scratchDC.SelectObject(wxNullBitmap);
+        wxImage coverage = scratch.ConvertToImage();
+        Page& page = pages.back();
+        unsigned char* alpha = page.image.GetAlpha();
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                alpha[(glyph.rect.y + y) * pageSize + glyph.rect.x + x] = coverage.GetData()[(y * width + x) * 3 + 1];
+            }
+        }
+        page.dirty = true;
+        return glyph;
+    }
+};
+
+// Every cache that can give memory back. Each reports its size and sheds its least recently used
+// entries on request; once the caches together pass the ceiling, or the system or the process's
+// cgroup runs short of memory, the cheapest to rebuild are shed first until they fit again.
+// What was shed and what drawing it again cost are counted so the ceiling can be tuned
+class CacheRegistry {
+public:
+    // Order of shedding, cheapest to rebuild first
+    enum Priority { PRIORITY_IMAGE_UPLOADS, PRIORITY_HIDDEN_TILES, PRIORITY_GLYPHS, PRIORITY_TILES, PRIORITY_STROKES };
+    enum { checkInterval = 1000, stallPercent = 10 }; // Milliseconds, and PSI stall share counted as pressure
+
+    size_t ceiling = 256 * 1024 * 1024; // Combined cache bytes
+
+    // shed(bytes) drops about that much, least recently used first, and returns what it freed
+    int Register(const wxString& name, Priority priority, std::function<size_t()> size, std::function<size_t(size_t)> shed) {
+        entries.push_back(Entry{ ++lastId, name, priority, size, shed });
+        return lastId;
+    }
+
+    void Unregister(int id) {
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [id](const Entry& entry) { return entry.id == id; }), entries.end());
+    }
+
+    void SetPriority(int id, Priority priority) {
+        if (Entry* entry = Find(id)) {
+            entry->priority = priority;
+        }
+    }
+
+    // Something shed was needed again and took this long to draw
+    void NoteRebuild(int id, long long microseconds) {
+        if (Entry* entry = Find(id)) {
+            Stats& counts = stats[entry->name];
+            ++counts.rebuilds;
+            counts.rebuildTime += microseconds;
+        }
+    }
+
+    size_t GetTotalBytes() const {
+        size_t bytes = 0;
+        for (const Entry& entry : entries) {
+            bytes += entry.size();
+        }
+        return bytes;
+    }
+
+    // Called from idle upkeep; looks at memory at most every checkInterval unless already shedding.
+    // Sheds one round and returns true while the caches are still over the target
+    bool Check() {
+        if (!shedding) {
+            if (sinceCheck.Time() < checkInterval) {
+                return false;
+            }
+            sinceCheck.Start();
+            size_t total = GetTotalBytes();
+            pressure = ReadPressure();
+            target = pressure.IsEmpty() ? ceiling : std::min(ceiling, total / 2); // Under pressure give back half
+            if (total <= target) {
+                return false;
+            }
+            shedding = true;
+            ++episodes;
+        }
+        std::vector<Entry*> order;
+        for (Entry& entry : entries) {
+            order.push_back(&entry);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const Entry* a, const Entry* b) { return a->priority < b->priority; });
+        size_t total = GetTotalBytes();
+        bool progress = false;
+        for (Entry* entry : order) {
+            if (total <= target) {
+                break;
+            }
+            size_t freed = std::min(entry->shed(total - target), total);
+            if (freed > 0) {
+                Stats& counts = stats[entry->name];
+                ++counts.sheds;
+                counts.shedBytes += freed;
+                total -= freed;
+                progress = true;
+            }
+        }
+        shedding = progress && total > target; // Some caches shed in slices; the rest may be in use
+        if (!shedding) {
+            sinceCheck.Start();
+        }
+        return shedding;
+    }
+
+    wxString Describe() const {
+        wxString report = wxString::Format("Ceiling: %zu MB\nCached: %zu KB\nPressure: %s\nTimes shed: %d\n\n"
+                                           "Shed first to last: image uploads, hidden document tiles, glyph atlases, "
+                                           "document tiles, stroke points\n",
+                                           ceiling / (1024 * 1024), GetTotalBytes() / 1024,
+                                           pressure.IsEmpty() ? wxString("none") : pressure, episodes);
+        std::map<wxString, size_t> sizes;
+        for (const Entry& entry : entries) {
+            sizes[entry.name] += entry.size();
+        }
+        for (const auto& counts : stats) {
+            sizes.emplace(counts.first, 0); // Caches since closed
+        }
+        for (const auto& size : sizes) {
+            auto found = stats.find(size.first);
+            Stats counts = found != stats.end() ? found->second : Stats();
+            report += wxString::Format("\n%s: %zu KB, shed %ld times (%zu KB), %ld rebuilt in %.1f ms",
+                                       size.first, size.second / 1024, counts.sheds, counts.shedBytes / 1024,
+                                       counts.rebuilds, counts.rebuildTime / 1000.0);
+        }
+        return report;
+    }
+
+private:
+    struct Entry {
+        int id;
+        wxString name;
+        Priority priority;
+        std::function<size_t()> size;
+        std::function<size_t(size_t)> shed;
+    };
+
+    struct Stats {
+        long sheds = 0;
+        size_t shedBytes = 0;
+        long rebuilds = 0;
+        long long rebuildTime = 0; // Microseconds
+    };
+
+    std::vector<Entry> entries;
+    std::map<wxString, Stats> stats; // By name, so closed documents still count
+    int lastId = 0;
+    wxStopWatch sinceCheck;
+    bool shedding = false;
+    size_t target = 0;
+    int episodes = 0;
+    wxString pressure; // Why the last check saw memory running short, if it did
+
+    Entry* Find(int id) {
+        for (Entry& entry : entries) {
+            if (entry.id == id) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Tasks stalled on memory for stallPercent of the last ten seconds, or the cgroup within a tenth
+    // of its limit; empty where neither is short or the signals are unavailable
+    static wxString ReadPressure() {
+#ifdef __linux__
+        std::ifstream stalls("/proc/pressure/memory");
+        std::string kind, average;
+        if (stalls >> kind >> average && kind == "some" && average.compare(0, 6, "avg10=") == 0) {
+            double percent = std::atof(average.c_str() + 6);
+            if (percent >= stallPercent) {
+                return wxString::Format("memory stalls %.1f%% of the time", percent);
+            }
+        }
+        std::ifstream groups("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(groups, line)) {
+            if (line.compare(0, 3, "0::") == 0) { // The unified hierarchy
+                std::string directory = "/sys/fs/cgroup" + line.substr(3);
+                std::ifstream currentFile(directory + "/memory.current");
+                std::ifstream limitFile(directory + "/memory.max");
+                unsigned long long current, limit;
+                if (currentFile >> current && limitFile >> limit && current > limit / 10 * 9) { // "max" when unlimited
+                    return wxString::Format("cgroup at %llu of %llu MB", current >> 20, limit >> 20);
+                }
+            }
+        }
+#endif
+        return wxString();
+    }
+};
+
+CacheRegistry& GetCacheRegistry() {
+    static CacheRegistry registry;
+    return registry;
+}
+
+// Atlases for every font and colour in use, evicted least recently used first above memoryLimit
+class GlyphCache {
+public:
+    GlyphCacheStats stats;
+
+    GlyphCache() {
+        registryId = GetCacheRegistry().Register("Glyph atlases", CacheRegistry::PRIORITY_GLYPHS,
+                                                 [this] { return GetMemoryBytes(); }, [this](size_t bytes) { return Shed(bytes); });
+    }
+
+    GlyphAtlas& GetAtlas(const wxFont& font, const wxColor& color) {
+        std::string key = (font.GetNativeFontInfoDesc() + wxString::Format("/%06x", color.GetRGB())).ToStdString();
+        auto found = atlases.find(key);
+        if (found != atlases.end()) {
+            lru.splice(lru.begin(), lru, found->second.lruPosition); // Most recently used first
+        }
+        else {
+            wxStopWatch watch;
+            lru.push_front(key);
+            found = atlases.emplace(key, Entry{ std::unique_ptr<GlyphAtlas>(new GlyphAtlas(font, color)), lru.begin() }).first;
+            if (shedKeys.erase(key)) {
+                GetCacheRegistry().NoteRebuild(registryId, watch.TimeInMicro());
+            }
+        }
+        Trim();
+        return *found->second.atlas;
+    }
+
+    size_t GetMemoryBytes() const {
+        size_t bytes = 0;
+        for (const auto& entry : atlases) {
+            bytes += entry.second.atlas->GetMemoryBytes();
+        }
+        return bytes;
+    }
+
+    void SetMemoryLimit(size_t bytes) {
+        memoryLimit = bytes;
+        Trim();
+    }
+
+    // Release every atlas; bitmaps must be gone before wx shuts down
+    void Clear() {
+        atlases.clear();
+        lru.clear();
+        shedKeys.clear();
+    }
+
+    // Drop atlases, least recently used first, until about bytes are freed; returns what was freed
+    size_t Shed(size_t bytes) {
+        size_t freed = 0;
+        while (!lru.empty() && freed < bytes) {
+            auto oldest = atlases.find(lru.back());
+            freed += oldest->second.atlas->GetMemoryBytes();
+            shedKeys.insert(lru.back());
+            atlases.erase(oldest);
+            lru.pop_back();
+        }
+        return freed;
+    }
+
+    wxString Describe() const {
+        long lookups = stats.hits + stats.misses;
+        return wxString::Format("Atlases: %d\nMemory: %lu KB of %lu KB\nHits: %ld\nMisses: %ld\nHit rate: %.1f%%\nEvictions: %ld",
+            static_cast<int>(atlases.size()), static_cast<unsigned long>(GetMemoryBytes() / 1024),
+            static_cast<unsigned long>(memoryLimit / 1024), stats.hits, stats.misses,
+            lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions);
+    }
+
+private:
+    struct Entry {
+        std::unique_ptr<GlyphAtlas> atlas;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    std::unordered_map<std::string, Entry> atlases;
+    std::list<std::string> lru;
+    std::set<std::string> shedKeys; // Dropped for memory, so building them again is a cost of shedding
+    size_t memoryLimit = 8 * 1024 * 1024;
+    int registryId = 0;
+
+    // The most recently used atlas is always kept, even if it alone exceeds the limit
+    void Trim() {
+        while (lru.size() > 1 && GetMemoryBytes() > memoryLimit) {
+            atlases.erase(lru.back());
+            lru.pop_back();
+            ++stats.evictions;
+        }
+    }
+};
+
+GlyphCache& GetGlyphCache() {
+    static GlyphCache cache;
+    return cache;
+}
+
+// Tag shared by one document's background tasks; tasks of hidden documents run last
+struct WorkGroup {
+    std::atomic<bool> visible{ true };
+};
+
+// Background threads for work that must not run on the UI thread (no wx GUI calls allowed)
+class WorkerPool {
+public:
+    WorkerPool() {
+        unsigned count = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (unsigned i = 0; i < count; ++i) {
+            threads.emplace_back([this] { Run(); });
+        }
+    }
+
+    ~WorkerPool() {
+        Shutdown();
+    }
+
+    // Tasks without a group count as visible
+    void Submit(std::function<void()> task, std::shared_ptr<const WorkGroup> group = nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(Task{ std::move(task), std::move(group) });
+        }
+        wakeUp.notify_one();
+    }
+
+    // Finish running tasks, drop queued ones and join the threads
+    void Shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            tasks.clear();
+        }
+        wakeUp.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+private:
+    struct Task {
+        std::function<void()> run;
+        std::shared_ptr<const WorkGroup> group;
+    };
+
+    std::vector<std::thread> threads;
+    std::deque<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+
+    void Run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (stopping) {
+                    return;
+                }
+                // Visibility is checked when a task is picked, so switching documents reorders queued work
+                auto next = std::find_if(tasks.begin(), tasks.end(), [](const Task& queued) {
+                    return !queued.group || queued.group->visible;
+                });
+                if (next == tasks.end()) {
+                    next = tasks.begin();
+                }
+                task = std::move(next->run);
+                tasks.erase(next);
+            }
+            task();
+        }
+    }
+};
+
+WorkerPool& GetWorkerPool() {
+    static WorkerPool pool;
+    return pool;
+}
+
+// Chunks a parallel loop over count items is split into: one per core, each worth a thread
+inline size_t ParallelChunks(size_t count) {
+    const size_t minChunk = 4096;
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, std::min(cores, count / minChunk));
+}
+
+// Run body(chunk, begin, end) over ParallelChunks(count) slices of [0, count), waiting for all of them.
+// For one-off bulk work on the UI thread; the worker pool stays free for background tasks
+inline void ParallelFor(size_t count, const std::function<void(size_t, size_t, size_t)>& body) {
+    size_t chunks = ParallelChunks(count);
+    std::vector<std::thread> threads;
+    for (size_t chunk = 1; chunk < chunks; ++chunk) {
+        threads.emplace_back([&body, chunk, chunks, count] { body(chunk, count * chunk / chunks, count * (chunk + 1) / chunks); });
+    }
+    body(0, 0, count / chunks);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Sort the slices in parallel, then merge neighbouring runs pairwise, also in parallel
+template <typename T, typename Less>
+void ParallelSort(std::vector<T>& items, Less less) {
+    size_t chunks = ParallelChunks(items.size());
+    std::vector<size_t> bounds;
+    for (size_t chunk = 0; chunk <= chunks; ++chunk) {
+        bounds.push_back(items.size() * chunk / chunks);
+    }
+    ParallelFor(items.size(), [&](size_t, size_t begin, size_t end) {
+        std::sort(items.begin() + begin, items.begin() + end, less);
+    });
+    for (size_t width = 1; width < chunks; width *= 2) {
+        std::vector<std::thread> threads;
+        for (size_t first = 0; first + width < chunks; first += 2 * width) {
+            size_t begin = bounds[first], middle = bounds[first + width], end = bounds[std::min(first + 2 * width, chunks)];
+            threads.emplace_back([&items, &less, begin, middle, end] {
+                std::inplace_merge(items.begin() + begin, items.begin() + middle, items.begin() + end, less);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+}
+
+// Lock-free queue between exactly one producer thread and one consumer thread. Each index is
+// only written by its own side; capacity must be a power of two
+template <typename T, size_t capacity>
+class SpscRing {
+public:
+    static_assert((capacity & (capacity - 1)) == 0, "SpscRing capacity must be a power of two");
+
+    // Producer side; false when full
+    bool TryPush(T&& value) {
+        size_t back = tail.load(std::memory_order_relaxed);
+        if (back - head.load(std::memory_order_acquire) == capacity) {
+            return false;
+        }
+        slots[back & (capacity - 1)] = std::move(value);
+        tail.store(back + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false when empty
+    bool TryPop(T& value) {
+        size_t front = head.load(std::memory_order_relaxed);
+        if (front == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots[front & (capacity - 1)]);
+        head.store(front + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool IsEmpty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots = std::vector<T>(capacity);
+    std::atomic<size_t> head{ 0 };
+    char padding[64]; // Keeps the two sides' indices off one cache line
+    std::atomic<size_t> tail{ 0 };
+};
+
+// Hardware cache misses of the calling thread, from perf counters where the kernel allows them (Linux only)
+class CacheMissCounter {
+public:
+    CacheMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~CacheMissCounter() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool IsOk() const {
+        return fd >= 0;
+    }
+
+    void Start() {
+#ifdef __linux__
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    long long Stop() {
+        long long count = 0;
+#ifdef __linux__
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd = -1;
+};
+
+// Upkeep that runs from idle events once input has paused. With nothing left to do it arms no timer
+// and requests no more idle events, so an idle app is not woken at all
+class IdleScheduler {
+public:
+    enum { quietDelay = 300, sliceTime = 8 }; // Milliseconds
+
+    // work runs one short step and returns true while more remains
+    void Start(std::function<bool()> work) {
+        this->work = work;
+        wxTheApp->Bind(wxEVT_IDLE, &IdleScheduler::OnIdle, this);
+        timer.Bind(wxEVT_TIMER, &IdleScheduler::OnTimer, this);
+        ResetStats();
+        Poke();
+    }
+
+    void Stop() {
+        timer.Stop();
+        work = nullptr;
+        active = false;
+    }
+
+    // There may be new work; start it once input has been quiet for quietDelay
+    void Poke() {
+        if (work) {
+            timer.StartOnce(quietDelay);
+        }
+    }
+
+    // Drawing pauses upkeep and pushes it back
+    void NoteInput() {
+        if (active || timer.IsRunning()) {
+            active = false;
+            timer.StartOnce(quietDelay);
+        }
+    }
+
+    // Wakeups and process CPU use since the last report
+    wxString Describe() {
+        double seconds = std::max(window.Time(), 1L) / 1000.0;
+        double cpuSeconds = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        wxString report = wxString::Format(
+            "Over the last %.1f s:\nIdle events: %.2f/s\nTimer wakeups: %.2f/s\nUpkeep steps: %d (%ld ms)\n"
+            "Process CPU: %.1f%%\nState: %s",
+            seconds, idleEvents / seconds, timerWakeups / seconds, steps, workTime, 100 * cpuSeconds / seconds,
+            active ? "working" : timer.IsRunning() ? "waiting for input to settle" : "quiet");
+        ResetStats();
+        return report;
+    }
+
+private:
+    std::function<bool()> work;
+    wxTimer timer;
+    bool active = false;
+    int idleEvents = 0;
+    int timerWakeups = 0;
+    int steps = 0;
+    long workTime = 0;
+    wxStopWatch window;
+    std::clock_t cpuStart = 0;
+
+    void ResetStats() {
+        idleEvents = timerWakeups = steps = 0;
+        workTime = 0;
+        window.Start();
+        cpuStart = std::clock();
+    }
+
+    void OnTimer(wxTimerEvent&) {
+        ++timerWakeups;
+        active = true;
+        wxWakeUpIdle();
+    }
+
+    void OnIdle(wxIdleEvent& event) {
+        event.Skip();
+        ++idleEvents;
+        if (!active || !work) {
+            return;
+        }
+        wxStopWatch slice;
+        bool more;
+        do {
+            more = work();
+            ++steps;
+        } while (more && slice.Time() < sliceTime);
+        workTime += slice.Time();
+        if (more) {
+            event.RequestMore();
+        }
+        else {
+            active = false;
+        }
+    }
+};
+
+IdleScheduler& GetIdleScheduler() {
+    static IdleScheduler scheduler;
+    return scheduler;
+}
+
+// Raster pixels split into reference-counted tiles; copies share tiles until one side writes
+class TiledRaster {
+public:
+    enum { tileSize = 256 };
+
+    TiledRaster() {}
+
+    explicit TiledRaster(const wxImage& image) : size(image.GetSize()) {
+        columns = (size.x + tileSize - 1) / tileSize;
+        rows = (size.y + tileSize - 1) / tileSize;
+        tiles.reserve(columns * rows);
+        for (int index = 0; index < columns * rows; ++index) {
+            tiles.push_back(std::make_shared<wxImage>(image.GetSubImage(GetTileRect(index))));
+        }
+    }
+
+    wxSize GetSize() const { return size; }
+    int GetColumns() const { return columns; }
+    int GetTileCount() const { return static_cast<int>(tiles.size()); }
+
+    wxRect GetTileRect(int index) const {
+        int x = (index % columns) * tileSize;
+        int y = (index / columns) * tileSize;
+        return wxRect(x, y, std::min<int>(tileSize, size.x - x), std::min<int>(tileSize, size.y - y));
+    }
+
+    const wxImage& GetTile(int index) const {
+        return *tiles[index];
+    }
+
+    // Copy the tile first if anyone else (history, another copy) still shares it
+    wxImage& GetWritableTile(int index) {
+        if (tiles[index].use_count() > 1) {
+            tiles[index] = std::make_shared<wxImage>(tiles[index]->Copy());
+        }
+        return *tiles[index];
+    }
+
+    bool SharesTile(const TiledRaster& other, int index) const {
+        return index < other.GetTileCount() && tiles[index] == other.tiles[index];
+    }
+
+    // Bytes held by this raster that other does not share
+    size_t GetUnsharedBytes(const TiledRaster& other) const {
+        size_t bytes = 0;
+        for (int index = 0; index < GetTileCount(); ++index) {
+            if (!SharesTile(other, index)) {
+                bytes += static_cast<size_t>(tiles[index]->GetWidth()) * tiles[index]->GetHeight() * 3;
+            }
+        }
+        return bytes;
+    }
+
+    // Paint a round-capped segment of the given radius, copying only the tiles it touches
+    bool StampSegment(const wxPoint& from, const wxPoint& to, int radius, const wxColor& color) {
+        wxRect area = wxRect(wxPoint(std::min(from.x, to.x), std::min(from.y, to.y)),
+                             wxPoint(std::max(from.x, to.x), std::max(from.y, to.y))).Inflate(radius);
+        area.Intersect(wxRect(size));
+        if (area.IsEmpty()) {
+            return false;
+        }
+        double dx = to.x - from.x;
+        double dy = to.y - from.y;
+        double lengthSquared = dx * dx + dy * dy;
+        for (int row = area.y / tileSize; row <= area.GetBottom() / tileSize; ++row) {
+            for (int column = area.x / tileSize; column <= area.GetRight() / tileSize; ++column) {
+                int index = row * columns + column;
+                wxRect tileRect = GetTileRect(index);
+                wxRect touched = tileRect;
+                touched.Intersect(area);
+                wxImage& tile = GetWritableTile(index);
+                unsigned char* rgb = tile.GetData();
+                for (int y = touched.y; y <= touched.GetBottom(); ++y) {
+                    for (int x = touched.x; x <= touched.GetRight(); ++x) {
+                        // Distance from the pixel to the closest point of the segment
+                        double t = lengthSquared > 0 ? ((x - from.x) * dx + (y - from.y) * dy) / lengthSquared : 0;
+                        t = std::max(0.0, std::min(1.0, t));
+                        double ex = x - (from.x + t * dx);
+                        double ey = y - (from.y + t * dy);
+                        if (ex * ex + ey * ey <= radius * radius) {
+                            unsigned char* pixel = rgb + ((y - tileRect.y) * tileRect.width + (x - tileRect.x)) * 3;
+                            pixel[0] = color.Red();
+                            pixel[1] = color.Green();
+                            pixel[2] = color.Blue();
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    wxSize size;
+    int columns = 0;
+    int rows = 0;
+    std::vector<std::shared_ptr<wxImage>> tiles;
+};
+
+// Pixels of an imported image, filled in by a decode task on the worker pool
+struct ImageSource {
+    enum { previewSize = 256 };
+
+    long id = 0;                 // Key for the tile bitmap cache
+    wxString path;
+    std::atomic<bool> ready{ false }; // Fields below are only read after this is set
+    bool failed = false;
+    wxImage preview;             // Whole image at low resolution, shown until tiles arrive
+    TiledRaster raster;          // Full resolution; edited on the UI thread once ready
+    std::function<void(const wxRect&)> onChanged; // UI thread only; image-local area to repaint
+    std::function<void()> onDecoded;              // UI thread only; the bounds are now the image's own
+
+    // Runs on a worker: decode, build the preview and split into tiles
+    void Decode() {
+        wxImage image;
+        if (image.LoadFile(path) && image.GetWidth() > 0 && image.GetHeight() > 0) {
+            wxSize size = image.GetSize();
+            double scale = std::min(1.0, static_cast<double>(previewSize) / std::max(size.x, size.y));
+            preview = image.Scale(std::max(1, static_cast<int>(size.x * scale)), std::max(1, static_cast<int>(size.y * scale)),
+                                  wxIMAGE_QUALITY_BOX_AVERAGE);
+            raster = TiledRaster(image);
+        }
+        else {
+            failed = true;
+        }
+        ready = true;
+    }
+};
+
+// Bitmaps for image tiles that have been shown, least recently used dropped above memoryLimit
+class ImageTileCache {
+public:
+    ImageTileCache() {
+        registryId = GetCacheRegistry().Register("Image uploads", CacheRegistry::PRIORITY_IMAGE_UPLOADS,
+                                                 [this] { return memoryBytes; }, [this](size_t bytes) { return Shed(bytes); });
+    }
+
+    bool Contains(long sourceId, int index) const {
+        return bitmaps.count(MakeKey(sourceId, index)) != 0;
+    }
+
+    // Whether speculative uploads still fit without evicting tiles that were shown
+    bool HasRoom() const {
+        return memoryBytes < memoryLimit / 4 * 3;
+    }
+
+    const wxBitmap* Find(long sourceId, int index) {
+        auto found = bitmaps.find(MakeKey(sourceId, index));
+        if (found == bitmaps.end()) {
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, found->second.lruPosition);
+        return &found->second.bitmap;
+    }
+
+    // Upload the pixels of one tile
+    void Insert(long sourceId, int index, const wxImage& pixels) {
+        Erase(sourceId, index);
+        long long key = MakeKey(sourceId, index);
+        wxStopWatch watch;
+        wxBitmap bitmap(pixels);
+        if (shedKeys.erase(key)) {
+            GetCacheRegistry().NoteRebuild(registryId, watch.TimeInMicro());
+        }
+        lru.push_front(key);
+        bitmaps[key] = Entry{ bitmap, lru.begin() };
+        memoryBytes += BitmapBytes(bitmap);
+        while (memoryBytes > memoryLimit && lru.size() > 1) {
+            auto oldest = bitmaps.find(lru.back());
+            memoryBytes -= BitmapBytes(oldest->second.bitmap);
+            bitmaps.erase(oldest);
+            lru.pop_back();
+        }
+    }
+
+    // Drop a tile whose pixels were edited
+    void Erase(long sourceId, int index) {
+        auto found = bitmaps.find(MakeKey(sourceId, index));
+        if (found != bitmaps.end()) {
+            memoryBytes -= BitmapBytes(found->second.bitmap);
+            lru.erase(found->second.lruPosition);
+            bitmaps.erase(found);
+        }
+    }
+
+    void Clear() {
+        bitmaps.clear();
+        lru.clear();
+        shedKeys.clear();
+        memoryBytes = 0;
+    }
+
+    // Drop tiles, least recently used first, until about bytes are freed; returns what was freed
+    size_t Shed(size_t bytes) {
+        size_t before = memoryBytes;
+        while (!lru.empty() && before - memoryBytes < bytes) {
+            long long key = lru.back();
+            Erase(static_cast<long>(key >> 32), static_cast<int>(static_cast<unsigned>(key)));
+            shedKeys.insert(key);
+        }
+        return before - memoryBytes;
+    }
+
+private:
+    struct Entry {
+        wxBitmap bitmap;
+        std::list<long long>::iterator lruPosition;
+    };
+
+    std::unordered_map<long long, Entry> bitmaps;
+    std::list<long long> lru;
+    std::set<long long> shedKeys; // Dropped for memory, so uploading them again is a cost of shedding
+    size_t memoryBytes = 0;
+    size_t memoryLimit = 64 * 1024 * 1024;
+    int registryId = 0;
+
+    static long long MakeKey(long sourceId, int index) {
+        return (static_cast<long long>(sourceId) << 32) | static_cast<unsigned>(index);
+    }
+
+    static size_t BitmapBytes(const wxBitmap& bitmap) {
+        return static_cast<size_t>(bitmap.GetWidth()) * bitmap.GetHeight() * 4;
+    }
+};
+
+ImageTileCache& GetImageTileCache() {
+    static ImageTileCache cache;
+    return cache;
+}
+
+// Byte stream used by the clipboard format; integers are stored little-endian
+class ShapeWriter {
+public:
+    std::vector<unsigned char> bytes;
+
+    void WriteByte(unsigned char value) {
+        bytes.push_back(value);
+    }
+
+    void WriteInt(int value) {
+        unsigned int bits = static_cast<unsigned int>(value);
+        for (int shift = 0; shift < 32; shift += 8) {
+            bytes.push_back(static_cast<unsigned char>(bits >> shift));
+        }
+    }
+
+    void WritePoint(const wxPoint& point) {
+        WriteInt(point.x);
+        WriteInt(point.y);
+    }
+
+    void WriteRect(const wxRect& rect) {
+        WriteInt(rect.x);
+        WriteInt(rect.y);
+        WriteInt(rect.width);
+        WriteInt(rect.height);
+    }
+
+    void WriteColor(const wxColor& color) {
+        WriteByte(color.Red());
+        WriteByte(color.Green());
+        WriteByte(color.Blue());
+    }
+
+    void WriteString(const wxString& text) {
+        std::string utf8 = text.utf8_string();
+        WriteInt(static_cast<int>(utf8.size()));
+        bytes.insert(bytes.end(), utf8.begin(), utf8.end());
+    }
+
+    void WritePoints(const std::vector<wxPoint>& points, const wxPoint& offset) {
+        WriteInt(static_cast<int>(points.size()));
+        for (const wxPoint& point : points) {
+            WritePoint(point + offset);
+        }
+    }
+};
+
+// Reads what ShapeWriter wrote; running past the end marks the reader failed instead of throwing
+class ShapeReader {
+public:
+    ShapeReader(const unsigned char* data, size_t size) : data(data), size(size) {}
+
+    bool IsOk() const {
+        return ok;
+    }
+
+    bool AtEnd() const {
+        return position == size;
+    }
+
+    size_t GetPosition() const {
+        return position;
+    }
+
+    unsigned char ReadByte() {
+        if (!Need(1)) {
+            return 0;
+        }
+        return data[position++];
+    }
+
+    int ReadInt() {
+        if (!Need(4)) {
+            return 0;
+        }
+        unsigned int bits = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            bits |= static_cast<unsigned int>(data[position++]) << shift;
+        }
+        return static_cast<int>(bits);
+    }
+
+    wxPoint ReadPoint() {
+        int x = ReadInt();
+        return wxPoint(x, ReadInt());
+    }
+
+    wxRect ReadRect() {
+        int x = ReadInt();
+        int y = ReadInt();
+        int width = ReadInt();
+        return wxRect(x, y, width, ReadInt());
+    }
+
+    wxColor ReadColor() {
+        unsigned char red = ReadByte();
+        unsigned char green = ReadByte();
+        return wxColor(red, green, ReadByte());
+    }
+
+    wxString ReadString() {
+        int length = ReadInt();
+        if (length < 0 || !Need(length)) {
+            return wxString();
+        }
+        wxString text = wxString::FromUTF8(reinterpret_cast<const char*>(data + position), length);
+        position += length;
+        return text;
+    }
+
+    std::vector<wxPoint> ReadPoints() {
+        int count = ReadInt();
+        std::vector<wxPoint> points;
+        if (count < 0 || !Need(static_cast<size_t>(count) * 8)) {
+            return points;
+        }
+        points.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            points.push_back(ReadPoint());
+        }
+        return points;
+    }
+
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t position = 0;
+    bool ok = true;
+
+    bool Need(size_t count) {
+        if (size - position < count) {
+            ok = false;
+        }
+        return ok;
+    }
+};
+
+// Whole file into memory; uses no wx GUI objects, so workers may call it
+bool ReadFileBytes(const wxString& path, std::vector<unsigned char>& bytes) {
+    std::ifstream file(path.fn_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+// Tags identifying each shape in the binary format; values must never change
+enum ShapeType : unsigned char {
+    SHAPE_CIRCLE = 1,
+    SHAPE_SQUARE,
+    SHAPE_FREEHAND,
+    SHAPE_ELLIPSE,
+    SHAPE_LINE,
+    SHAPE_RECTANGLE,
+    SHAPE_POLYGON,
+    SHAPE_TEXT,
+    SHAPE_IMAGE
+};
+
+// Pen and brush a shape is drawn with; shapes that match can share one wxGraphicsPath
+struct PathStyle {
+    enum Kind { none, fill, stroke }; // none: drawn on its own through Draw()
+    Kind kind = none;
+    wxColor color;
+    int width = 0;
+
+    static PathStyle Fill(const wxColor& color) {
+        return PathStyle{ fill, color, 1 }; // Outlined with wxBLACK_PEN like UseFillStyle
+    }
+
+    static PathStyle Stroke(const wxColor& color, int width) {
+        return PathStyle{ stroke, color, width };
+    }
+
+    bool operator==(const PathStyle& other) const {
+        return kind == other.kind && color == other.color && width == other.width;
+    }
+};
+
+// Base class for shapes
+class Shape {
+public:
+    virtual void Draw(wxDC& dc) = 0; // Pure virtual function for drawing
+    virtual ~Shape() {}
+    virtual void SetColor(const wxColor& color) = 0; // Set color for the shape
+    virtual wxRect GetBounds() const = 0; // Area touched when drawn, used for partial repaints
+    virtual Shape* Clone() const = 0; // Copy that shares immutable point data with this shape
+    virtual void Offset(const wxPoint& delta) = 0; // Move the shape without touching shared data
+    virtual void Write(ShapeWriter& out) const = 0; // Type tag followed by the shape's fields
+    virtual PathStyle GetPathStyle() const { return PathStyle(); } // For batched drawing; none by default
+    virtual void AddToPath(wxGraphicsPath&) const {} // Outline in document coordinates, if it has a path style
+    virtual wxRect GetOpaqueArea() const { return wxRect(); } // Painted fully opaque, conservatively; empty if none
+};
+
+// The shapes of ordered (document order) that are not entirely under a later shape's opaque area.
+// Only the most recent occluders are compared, which can miss some but never hides a visible shape
+inline std::vector<Shape*> CullOccluded(const std::vector<Shape*>& ordered) {
+    const size_t occluderLimit = 64;
+    std::vector<wxRect> occluders;
+    std::vector<Shape*> visible;
+    for (auto it = ordered.rbegin(); it != ordered.rend(); ++it) {
+        wxRect bounds = (*it)->GetBounds();
+        bool hidden = std::any_of(occluders.begin(), occluders.end(), [&](const wxRect& area) { return area.Contains(bounds); });
+        if (!hidden) {
+            visible.push_back(*it);
+            wxRect opaque = (*it)->GetOpaqueArea();
+            if (!opaque.IsEmpty() && occluders.size() < occluderLimit) {
+                occluders.push_back(opaque);
+            }
+        }
+    }
+    std::reverse(visible.begin(), visible.end());
+    return visible;
+}
+
+// Circle class (static, no pulsing)
+class Circle : public Shape {
+private:
+    wxPoint center;
+    int radius;
+    wxColor color;
+
+public:
+    Circle(const wxPoint& center, int radius, const wxColor& color)
+        : center(center), radius(radius), color(color) {}
+
+    void Draw(wxDC& dc) override {
+        UseFillStyle(dc, color);
+        dc.DrawCircle(center, radius);
+    }
+
+    PathStyle GetPathStyle() const override {
+        return PathStyle::Fill(color);
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.AddCircle(center.x, center.y, radius);
+    }
+
+    // The inscribed square, less a pixel for the rasterizer's rounding
+    wxRect GetOpaqueArea() const override {
+        int half = static_cast<int>(radius / std::sqrt(2.0)) - 1;
+        return half > 0 ? wxRect(center.x - half, center.y - half, 2 * half + 1, 2 * half + 1) : wxRect();
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return wxRect(center.x - radius, center.y - radius, 2 * radius + 1, 2 * radius + 1).Inflate(1);
+    }
+
+    Shape* Clone() const override {
+        return new Circle(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        center += delta;
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_CIRCLE);
+        out.WritePoint(center);
+        out.WriteInt(radius);
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxPoint center = in.ReadPoint();
+        int radius = in.ReadInt();
+        return new Circle(center, radius, in.ReadColor());
+    }
+};
+
+// Square class
+class Square : public Shape {
+private:
+    wxPoint topLeft;
+    int sideLength;
+    wxColor color;
+
+public:
+    Square(const wxPoint& topLeft, int sideLength, const wxColor& color)
+        : topLeft(topLeft), sideLength(sideLength), color(color) {}
+
+    void Draw(wxDC& dc) override {
+        UseFillStyle(dc, color);
+        dc.DrawRectangle(topLeft, wxSize(sideLength, sideLength));
+    }
+
+    PathStyle GetPathStyle() const override {
+        return PathStyle::Fill(color);
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.AddRectangle(topLeft.x, topLeft.y, sideLength, sideLength);
+    }
+
+    wxRect GetOpaqueArea() const override {
+        return wxRect(topLeft, wxSize(sideLength, sideLength));
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return wxRect(topLeft, wxSize(sideLength, sideLength)).Inflate(1);
+    }
+
+    Shape* Clone() const override {
+        return new Square(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        topLeft += delta;
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_SQUARE);
+        out.WritePoint(topLeft);
+        out.WriteInt(sideLength);
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxPoint topLeft = in.ReadPoint();
+        int sideLength = in.ReadInt();
+        return new Square(topLeft, sideLength, in.ReadColor());
+    }
+};
+
+// 64-bit hash of a byte range in the manner of xxHash64, for telling apart buffers cheaply
+unsigned long long HashBytes64(const void* data, size_t size, unsigned long long seed = 0) {
+    const unsigned long long prime1 = 11400714785074694791ull, prime2 = 14029467366897019727ull,
+        prime3 = 1609587929392839161ull, prime4 = 9650029242287828579ull, prime5 = 2870177450012600261ull;
+    auto rotate = [](unsigned long long value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+    auto round = [&](unsigned long long accumulator, unsigned long long input) {
+        return rotate(accumulator + input * prime2, 31) * prime1;
+    };
+    auto read = [](const unsigned char* at) {
+        unsigned long long value;
+        std::memcpy(&value, at, sizeof(value));
+        return value;
+    };
+    const unsigned char* at = static_cast<const unsigned char*>(data);
+    const unsigned char* end = at + size;
+    unsigned long long hash;
+    if (size >= 32) {
+        unsigned long long lanes[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+        for (; at + 32 <= end; at += 32) {
+            for (int lane = 0; lane < 4; ++lane) {
+                lanes[lane] = round(lanes[lane], read(at + 8 * lane));
+            }
+        }
+        hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+        for (unsigned long long lane : lanes) {
+            hash = (hash ^ round(0, lane)) * prime1 + prime4;
+        }
+    }
+    else {
+        hash = seed + prime5;
+    }
+    hash += size;
+    for (; at + 8 <= end; at += 8) {
+        hash = rotate(hash ^ round(0, read(at)), 27) * prime1 + prime4;
+    }
+    if (at + 4 <= end) {
+        unsigned word;
+        std::memcpy(&word, at, sizeof(word));
+        hash = rotate(hash ^ (word * prime1), 23) * prime2 + prime3;
+        at += 4;
+    }
+    for (; at < end; ++at) {
+        hash = rotate(hash ^ (*at * prime5), 11) * prime1;
+    }
+    hash = (hash ^ (hash >> 33)) * prime2;
+    hash = (hash ^ (hash >> 29)) * prime3;
+    return hash ^ (hash >> 32);
+}
+
+// Where the points of strokes paged out of memory are kept: an unlinked temporary file, mapped a
+// segment at a time and never unmapped, so reads on workers need no lock once they have an address.
+// Each stroke's points are written once, the first time it is paged out. Resident points of
+// finished strokes are counted here against budget, once per shared buffer
+class PointPager {
+public:
+    struct Span {
+        size_t segment = 0;
+        size_t offset = 0;
+        size_t count = 0; // None stored yet
+    };
+
+    enum { segmentSize = 64 * 1024 * 1024 };
+    size_t budget = 512 * 1024 * 1024; // Resident point bytes above which canvases page out cold strokes
+
+    ~PointPager() {
+#ifdef __linux__
+        for (const Segment& segment : segments) {
+            munmap(segment.data, segment.size);
+        }
+        if (file >= 0) {
+            close(file);
+        }
+#endif
+    }
+
+    // Copy points into the backing file; false where paging is unavailable or the disk is full
+    bool Store(const std::vector<wxPoint>& points, Span& span) {
+        size_t bytes = points.size() * sizeof(wxPoint);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (segments.empty() || segments.back().used + bytes > segments.back().size) {
+            size_t size = std::max<size_t>(segmentSize, (bytes + segmentSize - 1) / segmentSize * segmentSize);
+            if (!AddSegment(size)) {
+                return false;
+            }
+        }
+        Segment& segment = segments.back();
+        std::memcpy(segment.data + segment.used, points.data(), bytes);
+        span.segment = segments.size() - 1;
+        span.offset = segment.used;
+        span.count = points.size();
+        segment.used += bytes;
+        storedBytes += bytes;
+        return true;
+    }
+
+    // Safe on any thread; may wait for the disk while the pages come back in
+    std::vector<wxPoint> Read(const Span& span) {
+        const char* data;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            data = segments[span.segment].data + span.offset;
+            ++pageIns;
+        }
+        std::vector<wxPoint> points(span.count);
+        std::memcpy(points.data(), data, span.count * sizeof(wxPoint));
+        return points;
+    }
+
+    size_t GetResidentBytes() const {
+        return residentPoints * sizeof(wxPoint);
+    }
+
+    // Called as point buffers are created and released, which may be on a worker
+    void AddResident(size_t count) {
+        residentPoints += count;
+    }
+
+    void RemoveResident(size_t count) {
+        residentPoints -= count;
+    }
+
+    // A stroke let go of its points; they leave memory once no other resident stroke shares them
+    void NoteEviction() {
+        ++evictions;
+    }
+
+    // Page-ins requested and not yet delivered; until then some tiles show placeholders
+    size_t pendingReads = 0;
+
+    wxString Describe() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return wxString::Format("Resident stroke points: %zu KB of %zu KB budget\nBacking file: %zu KB in %zu segments\n"
+                                "Strokes paged out: %zu\nStrokes paged back in: %zu",
+                                GetResidentBytes() / 1024, budget / 1024, storedBytes / 1024, segments.size(), evictions, pageIns);
+    }
+
+private:
+    struct Segment {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+
+    std::mutex mutex; // Guards segments and the counts written off the UI thread
+    std::vector<Segment> segments;
+    int file = -1;
+    size_t fileSize = 0;
+    size_t storedBytes = 0;
+    std::atomic<size_t> residentPoints{ 0 };
+    size_t evictions = 0;
+    size_t pageIns = 0;
+
+    bool AddSegment(size_t size) {
+#ifdef __linux__
+        if (file < 0) {
+            wxString path = wxFileName::CreateTempFileName("paint-points");
+            if (path.IsEmpty()) {
+                return false;
+            }
+            file = open(path.fn_str(), O_RDWR);
+            wxRemoveFile(path); // Lives until closed, and goes with the process
+            if (file < 0) {
+                return false;
+            }
+        }
+        if (ftruncate(file, static_cast<off_t>(fileSize + size)) != 0) {
+            return false;
+        }
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, static_cast<off_t>(fileSize));
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        fileSize += size;
+        segments.push_back(Segment{ static_cast<char*>(data), size, 0 });
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+PointPager& GetPointPager() {
+    static PointPager pager;
+    return pager;
+}
+
+// Point buffers of finished strokes, one per distinct shape of stroke, so duplicated strokes and
+// reloaded copies of each other share their points wherever they sit. Only weakly held here
+class PointStore {
+public:
+    typedef std::shared_ptr<std::vector<wxPoint>> Buffer;
+
+    // The kept buffer equal to points if there is one, otherwise points becomes one. Of equal buffers
+    // the one from the latest relocation pass is given out, so new strokes join the laid-out copies
+    Buffer Intern(std::vector<wxPoint>&& points, unsigned long long hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer kept = Find(points, hash, 0);
+        if (kept) {
+            ++shared;
+            return kept;
+        }
+        return Add(std::move(points), hash, 0);
+    }
+
+    // Start a pass of Relocate calls, made as a layout recreates strokes in their new order
+    void BeginRelocation() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++relocation;
+    }
+
+    // A copy of current allocated now, next to whatever the caller allocated just before, unless a
+    // stroke relocated earlier in this pass already has one to share. The old buffer stays with the
+    // strokes still holding it and goes once they do
+    Buffer Relocate(const Buffer& current, unsigned long long hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer kept = Find(*current, hash, relocation);
+        return kept ? kept : Add(std::vector<wxPoint>(*current), hash, relocation);
+    }
+
+    // How many strokes were given an existing buffer since startup
+    size_t GetSharedCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shared;
+    }
+
+private:
+    struct Kept {
+        std::weak_ptr<std::vector<wxPoint>> buffer;
+        size_t relocation; // Pass that allocated it; 0 when interned
+    };
+
+    std::mutex mutex;
+    std::unordered_multimap<unsigned long long, Kept> buffers;
+    size_t shared = 0;
+    size_t sinceSweep = 0;
+    size_t relocation = 0;
+
+    // The live buffer equal to points from pass minPass or later, preferring the latest pass
+    Buffer Find(const std::vector<wxPoint>& points, unsigned long long hash, size_t minPass) {
+        Buffer found;
+        size_t foundPass = 0;
+        auto range = buffers.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.relocation < minPass || (found && it->second.relocation <= foundPass)) {
+                continue;
+            }
+            Buffer kept = it->second.buffer.lock();
+            if (kept && *kept == points) {
+                found = kept;
+                foundPass = it->second.relocation;
+            }
+        }
+        return found;
+    }
+
+    Buffer Add(std::vector<wxPoint>&& points, unsigned long long hash, size_t pass) {
+        if (++sinceSweep >= std::max<size_t>(1024, buffers.size() / 2)) {
+            Sweep();
+        }
+        size_t count = points.size();
+        Buffer buffer(new std::vector<wxPoint>(std::move(points)), [count](std::vector<wxPoint>* released) {
+            GetPointPager().RemoveResident(count);
+            delete released;
+        });
+        GetPointPager().AddResident(count);
+        buffers.emplace(hash, Kept{ buffer, pass });
+        return buffer;
+    }
+
+    // Forget buffers no stroke uses any more
+    void Sweep() {
+        for (auto it = buffers.begin(); it != buffers.end();) {
+            it = it->second.buffer.expired() ? buffers.erase(it) : std::next(it);
+        }
+        sinceSweep = 0;
+    }
+};
+
+PointStore& GetPointStore() {
+    static PointStore store;
+    return store;
+}
+
+// Freehand line class
+class FreehandLine : public Shape {
+private:
+    // Shared by clones and interned copies; copied before a shared buffer is changed. Null while paged out
+    mutable std::shared_ptr<std::vector<wxPoint>> points;
+    wxPoint offset;  // Applied at draw time so moving a copy never touches the shared points
+    wxRect bounds; // Grown as points are added, without the offset
+    wxColor color;
+    bool rainbowMode; // Enable rainbow mode for dynamic color changes
+    unsigned long long geometryHash = 0; // Of the interned points; 0 while the line is still being drawn
+    PointPager::Span paged;              // Where the points went the first time they were paged out
+    std::weak_ptr<const std::function<void(const wxRect&)>> repaint; // Canvas area to redraw when paged back in
+
+    // A page-in on its way; the line is cleared when it is deleted first
+    struct PageIn {
+        FreehandLine* line;
+        std::vector<wxPoint> points;
+    };
+    std::shared_ptr<PageIn> pageIn;
+
+public:
+    enum { penWidth = 2 };
+
+    FreehandLine(const wxColor& color, bool rainbowMode = false)
+        : points(std::make_shared<std::vector<wxPoint>>()), color(color), rainbowMode(rainbowMode) {}
+
+    FreehandLine(const FreehandLine& other)
+        : points(other.points), offset(other.offset), bounds(other.bounds), color(other.color), rainbowMode(other.rainbowMode),
+          geometryHash(other.geometryHash), paged(other.paged), repaint(other.repaint) {}
+
+    FreehandLine& operator=(const FreehandLine&) = delete;
+
+    ~FreehandLine() {
+        if (pageIn) {
+            pageIn->line = nullptr;
+        }
+    }
+
+    // A finished polyline, taking over its points
+    FreehandLine(const wxColor& color, std::vector<wxPoint>&& finished)
+        : points(std::make_shared<std::vector<wxPoint>>(std::move(finished))), color(color), rainbowMode(false) {
+        for (size_t i = 0; i < points->size(); ++i) {
+            bounds = i == 0 ? wxRect((*points)[i], wxSize(1, 1)) : bounds.Union(wxRect((*points)[i], wxSize(1, 1)));
+        }
+        Intern();
+    }
+
+    void AddPoint(const wxPoint& point) {
+        LoadPoints();
+        if (points.use_count() > 1 || geometryHash != 0) {
+            points = std::make_shared<std::vector<wxPoint>>(*points);
+            geometryHash = 0;
+        }
+        points->push_back(point - offset);
+        if (points->size() == 1) {
+            bounds = wxRect(point - offset, wxSize(1, 1));
+        }
+        else {
+            bounds.Union(wxRect(point - offset, wxSize(1, 1)));
+        }
+    }
+
+    // Points relative to GetOffset(), read back first if they were paged out
+    const std::vector<wxPoint>& GetPoints() const {
+        LoadPoints();
+        return *points;
+    }
+
+    bool IsResident() const {
+        return points != nullptr;
+    }
+
+    // Called by the canvas that takes the line: where to repaint once paged-out points are back.
+    // Without one, paged-out points are read back on the spot when drawn
+    void SetOwner(std::weak_ptr<const std::function<void(const wxRect&)>> handler) {
+        repaint = handler;
+    }
+
+    // Drop the points from memory, writing them to the pager the first time; only finished lines
+    bool Evict() {
+        if (!points || geometryHash == 0 || pageIn) {
+            return false;
+        }
+        if (paged.count == 0 && !GetPointPager().Store(*points, paged)) {
+            return false;
+        }
+        points.reset();
+        GetPointPager().NoteEviction();
+        return true;
+    }
+
+    // Read paged-out points back now
+    void LoadPoints() const {
+        if (!points) {
+            SetResident(GetPointPager().Read(paged));
+        }
+    }
+
+    wxPoint GetOffset() const {
+        return offset;
+    }
+
+    wxColor GetColor() const {
+        return color;
+    }
+
+    // Identifies the line's shape independent of where it sits, once finished
+    unsigned long long GetGeometryHash() const {
+        return geometryHash;
+    }
+
+    // Called once the line is finished: the points are moved to start at the origin, with the
+    // difference in the offset, and swapped for a stored buffer holding the same points
+    void Intern() {
+        if (geometryHash != 0 || points->empty()) {
+            return;
+        }
+        wxPoint origin = points->front();
+        std::vector<wxPoint> relative(*points);
+        for (wxPoint& point : relative) {
+            point -= origin;
+        }
+        offset += origin;
+        bounds.Offset(-origin.x, -origin.y);
+        geometryHash = std::max(1ull, HashBytes64(relative.data(), relative.size() * sizeof(wxPoint)));
+        SetResident(std::move(relative));
+    }
+
+    // Move resident points into a buffer allocated now, for layouts that recreate lines in a new order
+    void Relocate() {
+        if (points && geometryHash != 0) {
+            points = GetPointStore().Relocate(points, geometryHash);
+        }
+    }
+
+    void Draw(wxDC& dc) override {
+        if (!points && !repaint.expired()) {
+            // Outline until the points are paged back in on a worker
+            RequestPoints();
+            dc.SetPen(*wxLIGHT_GREY_PEN);
+            dc.SetBrush(*wxTRANSPARENT_BRUSH);
+            dc.DrawRectangle(GetBounds().Deflate(2));
+            return;
+        }
+        LoadPoints();
+        UseStrokeStyle(dc, color, penWidth); // Set the pen color and width
+        if (points->size() > 1) {
+            dc.DrawLines(points->size(), points->data(), offset.x, offset.y);
+        }
+    }
+
+    PathStyle GetPathStyle() const override {
+        return points && points->size() > 1 ? PathStyle::Stroke(color, penWidth) : PathStyle(); // Paged-out lines draw themselves
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.MoveToPoint(points->front().x + offset.x, points->front().y + offset.y);
+        for (size_t i = 1; i < points->size(); ++i) {
+            path.AddLineToPoint((*points)[i].x + offset.x, (*points)[i].y + offset.y);
+        }
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        wxRect area = bounds;
+        area.Offset(offset);
+        return area.Inflate(2); // Room for the pen width
+    }
+
+    Shape* Clone() const override {
+        return new FreehandLine(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        offset += delta;
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_FREEHAND);
+        out.WriteColor(color);
+        out.WritePoints(points ? *points : GetPointPager().Read(paged), offset); // Paged-out points stay out
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxColor color = in.ReadColor();
+        return new FreehandLine(color, in.ReadPoints());
+    }
+
+    // Dynamically change color in rainbow mode
+    void UpdateRainbowColor() {
+        if (rainbowMode) {
+            color = wxColor(rand() % 256, rand() % 256, rand() % 256); // Random RGB values
+        }
+    }
+
+private:
+    // Take interned points as the line's own; the store counts them with the pager
+    void SetResident(std::vector<wxPoint>&& loaded) const {
+        points = GetPointStore().Intern(std::move(loaded), geometryHash);
+    }
+
+    void RequestPoints() {
+        if (pageIn) {
+            return;
+        }
+        pageIn = std::make_shared<PageIn>();
+        pageIn->line = this;
+        std::shared_ptr<PageIn> request = pageIn;
+        PointPager::Span span = paged;
+        ++GetPointPager().pendingReads;
+        GetWorkerPool().Submit([request, span] {
+            request->points = GetPointPager().Read(span);
+            wxTheApp->CallAfter([request] {
+                --GetPointPager().pendingReads;
+                if (FreehandLine* line = request->line) {
+                    line->pageIn.reset();
+                    if (!line->points) {
+                        line->SetResident(std::move(request->points));
+                    }
+                    if (std::shared_ptr<const std::function<void(const wxRect&)>> handler = line->repaint.lock()) {
+                        (*handler)(line->GetBounds());
+                    }
+                }
+            });
+        });
+    }
+};
+
+// Ellipse class (named to avoid the Win32 Ellipse() function)
+class EllipseShape : public Shape {
+private:
+    wxRect box;
+    wxColor color;
+
+public:
+    EllipseShape(const wxRect& box, const wxColor& color) : box(box), color(color) {}
+
+    void Draw(wxDC& dc) override {
+        UseFillStyle(dc, color);
+        dc.DrawEllipse(box);
+    }
+
+    PathStyle GetPathStyle() const override {
+        return PathStyle::Fill(color);
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.AddEllipse(box.x, box.y, box.width, box.height);
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return box.Inflate(1, 1);
+    }
+
+    Shape* Clone() const override {
+        return new EllipseShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        box.Offset(delta);
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_ELLIPSE);
+        out.WriteRect(box);
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxRect box = in.ReadRect();
+        return new EllipseShape(box, in.ReadColor());
+    }
+};
+
+// Straight line class
+class LineShape : public Shape {
+private:
+    wxPoint start;
+    wxPoint end;
+    wxColor color;
+
+public:
+    LineShape(const wxPoint& start, const wxPoint& end, const wxColor& color) : start(start), end(end), color(color) {}
+
+    void Draw(wxDC& dc) override {
+        UseStrokeStyle(dc, color, 2);
+        dc.DrawLine(start, end);
+    }
+
+    PathStyle GetPathStyle() const override {
+        return PathStyle::Stroke(color, 2);
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.MoveToPoint(start.x, start.y);
+        path.AddLineToPoint(end.x, end.y);
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return wxRect(wxPoint(std::min(start.x, end.x), std::min(start.y, end.y)),
+                      wxPoint(std::max(start.x, end.x), std::max(start.y, end.y))).Inflate(2);
+    }
+
+    Shape* Clone() const override {
+        return new LineShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        start += delta;
+        end += delta;
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_LINE);
+        out.WritePoint(start);
+        out.WritePoint(end);
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxPoint start = in.ReadPoint();
+        wxPoint end = in.ReadPoint();
+        return new LineShape(start, end, in.ReadColor());
+    }
+};
+
+// Rectangle class with independent width and height
+class RectangleShape : public Shape {
+private:
+    wxRect rect;
+    wxColor color;
+
+public:
+    RectangleShape(const wxRect& rect, const wxColor& color) : rect(rect), color(color) {}
+
+    void Draw(wxDC& dc) override {
+        UseFillStyle(dc, color);
+        dc.DrawRectangle(rect);
+    }
+
+    PathStyle GetPathStyle() const override {
+        return PathStyle::Fill(color);
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.AddRectangle(rect.x, rect.y, rect.width, rect.height);
+    }
+
+    wxRect GetOpaqueArea() const override {
+        return rect;
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return rect.Inflate(1, 1);
+    }
+
+    Shape* Clone() const override {
+        return new RectangleShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        rect.Offset(delta);
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_RECTANGLE);
+        out.WriteRect(rect);
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxRect rect = in.ReadRect();
+        return new RectangleShape(rect, in.ReadColor());
+    }
+};
+
+// Filled polygon class
+class PolygonShape : public Shape {
+private:
+    std::shared_ptr<const std::vector<wxPoint>> points; // Never changed after construction, so clones share it
+    wxPoint offset;
+    wxRect bounds;
+    wxColor color;
+
+public:
+    PolygonShape(const std::vector<wxPoint>& points, const wxColor& color)
+        : points(std::make_shared<const std::vector<wxPoint>>(points)), color(color) {
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (i == 0) {
+                bounds = wxRect(points[i], wxSize(1, 1));
+            }
+            else {
+                bounds.Union(wxRect(points[i], wxSize(1, 1)));
+            }
+        }
+    }
+
+    void Draw(wxDC& dc) override {
+        UseFillStyle(dc, color);
+        if (points->size() > 2) {
+            dc.DrawPolygon(points->size(), points->data(), offset.x, offset.y);
+        }
+        else if (points->size() == 2) {
+            dc.DrawLine((*points)[0] + offset, (*points)[1] + offset); // Still being placed
+        }
+    }
+
+    PathStyle GetPathStyle() const override {
+        return points->size() > 2 ? PathStyle::Fill(color) : PathStyle();
+    }
+
+    void AddToPath(wxGraphicsPath& path) const override {
+        path.MoveToPoint(points->front().x + offset.x, points->front().y + offset.y);
+        for (size_t i = 1; i < points->size(); ++i) {
+            path.AddLineToPoint((*points)[i].x + offset.x, (*points)[i].y + offset.y);
+        }
+        path.CloseSubpath();
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        wxRect area = bounds;
+        area.Offset(offset);
+        return area.Inflate(1);
+    }
+
+    Shape* Clone() const override {
+        return new PolygonShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        offset += delta;
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_POLYGON);
+        out.WriteColor(color);
+        out.WritePoints(*points, offset);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxColor color = in.ReadColor();
+        return new PolygonShape(in.ReadPoints(), color);
+    }
+};
+
+// Text annotation drawn from the glyph cache
+class TextShape : public Shape {
+private:
+    wxPoint position;
+    wxString text;
+    wxFont font;
+    wxColor color;
+    wxRect bounds;
+
+public:
+    TextShape(const wxPoint& position, const wxString& text, const wxFont& font, const wxColor& color)
+        : position(position), text(text), font(font), color(color) {
+        GlyphCache& cache = GetGlyphCache();
+        bounds = wxRect(position, cache.GetAtlas(font, color).MeasureText(text, cache.stats));
+    }
+
+    void Draw(wxDC& dc) override {
+        GlyphCache& cache = GetGlyphCache();
+        cache.GetAtlas(font, color).DrawText(dc, text, position, cache.stats);
+    }
+
+    void SetColor(const wxColor& color) override {
+        this->color = color;
+    }
+
+    wxRect GetBounds() const override {
+        return bounds.Inflate(1, 1);
+    }
+
+    Shape* Clone() const override {
+        return new TextShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        position += delta;
+        bounds.Offset(delta);
+    }
+
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_TEXT);
+        out.WritePoint(position);
+        out.WriteString(text);
+        out.WriteString(font.GetNativeFontInfoDesc());
+        out.WriteColor(color);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxPoint position = in.ReadPoint();
+        wxString text = in.ReadString();
+        wxFont font;
+        if (!font.SetNativeFontInfo(in.ReadString())) {
+            font = *wxNORMAL_FONT;
+        }
+        return new TextShape(position, text, font, in.ReadColor());
+    }
+};
+
+// Imported picture; decoded in the background and drawn tile by tile as tiles become visible
+class ImageShape : public Shape {
+private:
+    wxPoint position;
+    std::shared_ptr<ImageSource> source;
+    wxBitmap previewBitmap;
+    std::vector<char> queued;   // Tiles waiting for a bitmap upload
+    std::vector<int> uploads;
+    bool uploadScheduled = false;
+    bool decodeStarted = false;
+    std::function<void(const wxRect&)> repaint; // Canvas area to redraw when content arrives
+    std::function<void(Shape*, const wxRect&)> resized; // Told the placeholder bounds once the real size is known
+    std::shared_ptr<char> alive = std::make_shared<char>(); // Expires with the shape, guards deferred uploads
+    enum { uploadsPerStep = 8 };                // Tile bitmaps created per event loop turn
+    enum { placeholderWidth = 200, placeholderHeight = 150 }; // Bounds until the decode finishes
+
+public:
+    ImageShape(const wxPoint& position, const wxString& path)
+        : position(position), source(std::make_shared<ImageSource>()) {
+        source->path = path;
+        Attach();
+    }
+
+    // Copies share the decoded tiles; either side copies a tile only when it erases into it
+    ImageShape(const ImageShape& other) : position(other.position), source(std::make_shared<ImageSource>()) {
+        source->path = other.source->path;
+        Attach();
+        if (!other.source->ready) {
+            return; // Decoded once a document takes the copy
+        }
+        source->failed = other.source->failed;
+        source->preview = other.source->preview;
+        source->raster = other.source->raster;
+        source->ready = true;
+    }
+
+    ~ImageShape() {
+        source->onChanged = nullptr;
+        source->onDecoded = nullptr;
+    }
+
+    // Called by the canvas that takes the shape: where repaints and the change from placeholder to
+    // real bounds go, and whose priority the decode gets
+    void SetOwner(std::function<void(const wxRect&)> handler, std::function<void(Shape*, const wxRect&)> onResized,
+                  std::shared_ptr<const WorkGroup> group) {
+        repaint = handler;
+        resized = onResized;
+        if (!decodeStarted && !source->ready) {
+            StartDecode(group);
+        }
+    }
+
+    void Draw(wxDC& dc) override {
+        if (!source->ready || source->failed) {
+            // Placeholder frame until the decode finishes
+            dc.SetPen(*wxBLACK_DASHED_PEN);
+            dc.SetBrush(*wxTheBrushList->FindOrCreateBrush(*wxLIGHT_GREY));
+            dc.DrawRectangle(GetBounds());
+            return;
+        }
+        if (!previewBitmap.IsOk()) {
+            previewBitmap = wxBitmap(source->preview);
+            queued.assign(source->raster.GetTileCount(), 0);
+        }
+        const TiledRaster& raster = source->raster;
+        wxRect target(wxPoint(dc.DeviceToLogicalX(0), dc.DeviceToLogicalY(0)), dc.GetSize());
+        wxRect visible = wxRect(position, raster.GetSize()).Intersect(target);
+        if (visible.IsEmpty()) {
+            return;
+        }
+        ImageTileCache& cache = GetImageTileCache();
+        wxMemoryDC previewDC;
+        previewDC.SelectObjectAsSource(previewBitmap);
+        double previewScale = static_cast<double>(source->preview.GetWidth()) / raster.GetSize().x;
+        int firstColumn = (visible.x - position.x) / TiledRaster::tileSize;
+        int lastColumn = (visible.GetRight() - position.x) / TiledRaster::tileSize;
+        int firstRow = (visible.y - position.y) / TiledRaster::tileSize;
+        int lastRow = (visible.GetBottom() - position.y) / TiledRaster::tileSize;
+        for (int row = firstRow; row <= lastRow; ++row) {
+            for (int column = firstColumn; column <= lastColumn; ++column) {
+                int index = row * raster.GetColumns() + column;
+                wxRect tile = raster.GetTileRect(index);
+                if (const wxBitmap* bitmap = cache.Find(source->id, index)) {
+                    dc.DrawBitmap(*bitmap, position.x + tile.x, position.y + tile.y);
+                    continue;
+                }
+                // Stretch the matching part of the preview and stream the real tile in later
+                dc.StretchBlit(position.x + tile.x, position.y + tile.y, tile.width, tile.height, &previewDC,
+                               static_cast<int>(tile.x * previewScale), static_cast<int>(tile.y * previewScale),
+                               std::max(1, static_cast<int>(tile.width * previewScale)),
+                               std::max(1, static_cast<int>(tile.height * previewScale)));
+                if (!queued[index]) {
+                    queued[index] = 1;
+                    uploads.push_back(index);
+                }
+            }
+        }
+        ScheduleUploads();
+    }
+
+    void SetColor(const wxColor&) override {
+        // Images keep their own pixels
+    }
+
+    wxRect GetBounds() const override {
+        if (!source->ready || source->failed) {
+            return wxRect(position, wxSize(placeholderWidth, placeholderHeight));
+        }
+        return wxRect(position, source->raster.GetSize());
+    }
+
+    Shape* Clone() const override {
+        return new ImageShape(*this);
+    }
+
+    void Offset(const wxPoint& delta) override {
+        position += delta;
+    }
+
+    // Images are stored by path and decoded again when read
+    void Write(ShapeWriter& out) const override {
+        out.WriteByte(SHAPE_IMAGE);
+        out.WritePoint(position);
+        out.WriteString(source->path);
+    }
+
+    static Shape* Read(ShapeReader& in) {
+        wxPoint position = in.ReadPoint();
+        return new ImageShape(position, in.ReadString());
+    }
+
+    // Upload the uncached tile nearest the viewport ahead of it being shown. Returns false once
+    // every tile is cached, or when the cache has no spare room for guesses
+    bool WarmTile(const wxRect& viewport) {
+        if (!source->ready || source->failed || queued.empty() || !GetImageTileCache().HasRoom()) {
+            return false;
+        }
+        const TiledRaster& raster = source->raster;
+        int best = -1;
+        long long bestDistance = 0;
+        for (int index = 0; index < raster.GetTileCount(); ++index) {
+            if (queued[index] || GetImageTileCache().Contains(source->id, index)) {
+                continue;
+            }
+            wxRect tile = raster.GetTileRect(index);
+            tile.Offset(position);
+            long long dx = std::max(0, std::max(tile.x - viewport.GetRight(), viewport.x - tile.GetRight()));
+            long long dy = std::max(0, std::max(tile.y - viewport.GetBottom(), viewport.y - tile.GetBottom()));
+            if (best < 0 || dx * dx + dy * dy < bestDistance) {
+                best = index;
+                bestDistance = dx * dx + dy * dy;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        GetImageTileCache().Insert(source->id, best, raster.GetTile(best));
+        return true;
+    }
+
+    // Erase along a freehand stroke; before receives the untouched raster for undo
+    bool EraseStroke(const std::vector<wxPoint>& points, const wxPoint& strokeOffset, int width, TiledRaster& before) {
+        if (!source->ready || source->failed || points.size() < 2) {
+            return false;
+        }
+        TiledRaster edited = source->raster; // Shares every tile until StampSegment writes
+        bool changed = false;
+        wxPoint toImage = strokeOffset - position;
+        for (size_t i = 1; i < points.size(); ++i) {
+            changed |= edited.StampSegment(points[i - 1] + toImage, points[i] + toImage, width / 2, *wxWHITE);
+        }
+        if (changed) {
+            before = edited;
+            SwapRaster(before); // Leaves the old pixels in before
+        }
+        return changed;
+    }
+
+    // Exchange pixels with a history snapshot; only tiles that differ are re-uploaded and repainted
+    void SwapRaster(TiledRaster& other) {
+        std::swap(source->raster, other);
+        for (int index = 0; index < source->raster.GetTileCount(); ++index) {
+            if (!source->raster.SharesTile(other, index)) {
+                GetImageTileCache().Erase(source->id, index);
+                source->onChanged(source->raster.GetTileRect(index));
+            }
+        }
+    }
+
+    // Bytes a history snapshot keeps alive beyond what the current pixels already share
+    size_t GetHistoryBytes(const TiledRaster& snapshot) const {
+        return snapshot.GetUnsharedBytes(source->raster);
+    }
+
+private:
+    // The worker holds the source alive; the notification is dropped if the shape is gone by then
+    void StartDecode(std::shared_ptr<const WorkGroup> group) {
+        decodeStarted = true;
+        std::weak_ptr<ImageSource> weakSource = source;
+        std::shared_ptr<ImageSource> decodeSource = source;
+        GetWorkerPool().Submit([decodeSource, weakSource] {
+            decodeSource->Decode();
+            wxTheApp->CallAfter([weakSource] {
+                std::shared_ptr<ImageSource> decoded = weakSource.lock();
+                if (decoded && decoded->failed) {
+                    wxLogError("Could not load image '%s'", decoded->path.c_str());
+                }
+                if (decoded && !decoded->failed && decoded->onDecoded) {
+                    decoded->onDecoded(); // Indexed at its real size before the repaint looks it up
+                }
+                if (decoded && decoded->onChanged) {
+                    wxSize size = decoded->raster.GetSize();
+                    decoded->onChanged(wxRect(0, 0, std::max<int>(size.x, placeholderWidth), std::max<int>(size.y, placeholderHeight)));
+                }
+                GetIdleScheduler().Poke(); // Tiles to warm
+            });
+        }, group);
+    }
+
+    // Give the source a fresh cache id and route its change notifications through this shape
+    void Attach() {
+        static long nextId = 1;
+        source->id = nextId++;
+        source->onChanged = [this](const wxRect& area) {
+            wxRect canvasArea = area;
+            canvasArea.Offset(position);
+            if (repaint) {
+                repaint(canvasArea);
+            }
+        };
+        source->onDecoded = [this] {
+            if (resized) {
+                resized(this, wxRect(position, wxSize(placeholderWidth, placeholderHeight)));
+            }
+        };
+    }
+
+    // Turn a few queued tiles into bitmaps per event loop turn so the UI never stalls on a big image
+    void ScheduleUploads() {
+        if (uploads.empty() || uploadScheduled) {
+            return;
+        }
+        uploadScheduled = true;
+        std::weak_ptr<char> weakAlive = alive;
+        wxTheApp->CallAfter([this, weakAlive] {
+            if (weakAlive.expired()) {
+                return; // Shape was deleted before the upload ran
+            }
+            uploadScheduled = false;
+            size_t count = std::min<size_t>(uploads.size(), uploadsPerStep);
+            std::vector<int> batch(uploads.begin(), uploads.begin() + count);
+            uploads.erase(uploads.begin(), uploads.begin() + count);
+            for (int index : batch) {
+                GetImageTileCache().Insert(source->id, index, source->raster.GetTile(index));
+                queued[index] = 0;
+            }
+            for (int index : batch) {
+                source->onChanged(source->raster.GetTileRect(index)); // Redraws pick up the new bitmap
+            }
+            ScheduleUploads();
+        });
+    }
+};
+
+// Read one shape written by Shape::Write; nullptr for unknown tags or truncated data
+Shape* ReadShape(ShapeReader& in) {
+    Shape* shape = nullptr;
+    switch (in.ReadByte()) {
+    case SHAPE_CIRCLE: shape = Circle::Read(in); break;
+    case SHAPE_SQUARE: shape = Square::Read(in); break;
+    case SHAPE_FREEHAND: shape = FreehandLine::Read(in); break;
+    case SHAPE_ELLIPSE: shape = EllipseShape::Read(in); break;
+    case SHAPE_LINE: shape = LineShape::Read(in); break;
+    case SHAPE_RECTANGLE: shape = RectangleShape::Read(in); break;
+    case SHAPE_POLYGON: shape = PolygonShape::Read(in); break;
+    case SHAPE_TEXT: shape = TextShape::Read(in); break;
+    case SHAPE_IMAGE: shape = ImageShape::Read(in); break;
+    default: return nullptr;
+    }
+    if (!in.IsOk()) {
+        delete shape;
+        return nullptr;
+    }
+    return shape;
+}
+
+// Shape placed by clicking or dragging instead of drawing freehand
+enum ShapeTool {
+    TOOL_NONE,
+    TOOL_CIRCLE,
+    TOOL_SQUARE,
+    TOOL_ELLIPSE,
+    TOOL_LINE,
+    TOOL_RECTANGLE,
+    TOOL_POLYGON,
+    TOOL_TEXT,
+    TOOL_SELECT // Not a shape: picks shapes for copy and paste
+};
+
+const char* benchmarkWords[] = { "Note", "Gate 7", "Pump station", "TODO", "Revision B", "Valve" };
+
+// Random shape of the given kind inside area, used by the render benchmark
+Shape* CreateBenchmarkShape(ShapeTool kind, const wxSize& area, const wxColor& color) {
+    wxPoint at(rand() % area.x, rand() % area.y);
+    int size = 5 + rand() % 60;
+    switch (kind) {
+    case TOOL_CIRCLE:
+        return new Circle(at, size / 2, color);
+    case TOOL_SQUARE:
+        return new Square(at, size, color);
+    case TOOL_ELLIPSE:
+        return new EllipseShape(wxRect(at, wxSize(size, size / 2 + 1)), color);
+    case TOOL_LINE:
+        return new LineShape(at, at + wxPoint(size, size / 3), color);
+    case TOOL_RECTANGLE:
+        return new RectangleShape(wxRect(at, wxSize(size, size / 2 + 1)), color);
+    case TOOL_POLYGON: {
+        std::vector<wxPoint> points;
+        for (int i = 0; i < 6; ++i) {
+            points.push_back(at + wxPoint(rand() % size, rand() % size));
+        }
+        return new PolygonShape(points, color);
+    }
+    case TOOL_TEXT:
+        return new TextShape(at, benchmarkWords[rand() % 6], *wxNORMAL_FONT, color);
+    default: {
+        FreehandLine* line = new FreehandLine(color);
+        for (int i = 0; i < 50; ++i) {
+            line->AddPoint(at + wxPoint(rand() % size, rand() % size));
+        }
+        return line;
+    }
+    }
+}
+
+// Shapes built by code rather than the mouse, for generated diagrams. PaintCanvas::InsertBatch
+// commits them as one step; anything not inserted is deleted with the batch
+class ShapeBatch {
+public:
+    ShapeBatch() {}
+    ShapeBatch(const ShapeBatch&) = delete;
+    ShapeBatch& operator=(const ShapeBatch&) = delete;
+
+    ~ShapeBatch() {
+        for (Shape* shape : shapes) {
+            delete shape;
+        }
+    }
+
+    // Room for count shapes in total; the Add calls leave growth to the vector
+    void Reserve(size_t count) {
+        shapes.reserve(count);
+    }
+
+    // count circles, centres[i] with radii[i]
+    void AddCircles(const wxPoint* centres, const int* radii, size_t count, const wxColor& color) {
+        for (size_t i = 0; i < count; ++i) {
+            shapes.push_back(new Circle(centres[i], radii[i], color));
+        }
+    }
+
+    void AddSquares(const wxPoint* topLefts, const int* sides, size_t count, const wxColor& color) {
+        for (size_t i = 0; i < count; ++i) {
+            shapes.push_back(new Square(topLefts[i], sides[i], color));
+        }
+    }
+
+    // One polyline through count points, drawn like a freehand stroke
+    void AddPolyline(const wxPoint* points, size_t count, const wxColor& color) {
+        if (count > 0) {
+            shapes.push_back(new FreehandLine(color, std::vector<wxPoint>(points, points + count)));
+        }
+    }
+
+    size_t GetCount() const {
+        return shapes.size();
+    }
+
+    // Hand the shapes over, leaving the batch empty
+    std::vector<Shape*> Release() {
+        std::vector<Shape*> released;
+        released.swap(shapes);
+        return released;
+    }
+
+private:
+    std::vector<Shape*> shapes;
+};
+
+// Shapes last copied in this process; pastes clone these instead of decoding the system clipboard
+struct ShapeClipboard {
+    std::vector<std::unique_ptr<Shape>> shapes;
+    unsigned int token[2] = { 0, 0 }; // Also written into the clipboard data to recognise our own copy
+    int pasteCount = 0;               // Each paste of the same copy lands a little further away
+};
+
+ShapeClipboard& GetShapeClipboard() {
+    static ShapeClipboard clipboard;
+    return clipboard;
+}
+
+// System clipboard format for our binary shape data
+const wxDataFormat& GetShapesFormat() {
+    static wxDataFormat format("PaintApp.Shapes");
+    return format;
+}
+
+const unsigned int shapesMagic = 0x53544e50; // "PNTS"
+const int shapesVersion = 1;
+
+const unsigned int documentMagic = 0x44544e50; // "PNTD"
+const int documentVersion = 1;
+
+// Records in a document file; a document is the journal of its edits, replayed on open
+enum JournalRecord : unsigned char {
+    RECORD_ADD = 1, // One shape appended on top
+    RECORD_REMOVE   // Count of newest shapes taken away by an undo
+};
+
+// Document edits since the last save; saving to the same file appends just these records
+class Journal {
+public:
+    const wxString& GetPath() const {
+        return path;
+    }
+
+    bool IsModified() const {
+        return !pending.bytes.empty();
+    }
+
+    void RecordAdd(const std::vector<Shape*>& added) {
+        ++edits;
+        for (Shape* shape : added) {
+            pending.WriteByte(RECORD_ADD);
+            shape->Write(pending);
+        }
+        pendingRecords += added.size();
+    }
+
+    void RecordRemove(int count) {
+        ++edits;
+        pending.WriteByte(RECORD_REMOVE);
+        pending.WriteInt(count);
+        ++pendingRecords;
+    }
+
+    // Worth rewriting when many saved records replay to nothing (undone adds and the removals themselves).
+    // Only a saved document qualifies, since a rewrite also stores whatever is pending
+    bool NeedsCompaction(size_t liveShapes) const {
+        size_t waste = fileRecords - std::min(fileRecords, liveShapes);
+        return !path.IsEmpty() && !IsModified() && waste >= 64 && waste * 4 >= liveShapes;
+    }
+
+    // Changes to the document since the journal was created, recorded or loaded; work that spans
+    // several turns of the event loop checks it to see whether the document moved on meanwhile
+    size_t GetEditCount() const {
+        return edits;
+    }
+
+    // Bytes in the file as this journal last loaded or wrote it
+    size_t GetFileLength() const {
+        return fileLength;
+    }
+
+    // Append the pending records, or write the whole document when saving somewhere new
+    bool Save(const wxString& target, const std::vector<Shape*>& shapes) {
+        if (target != path || !wxFileExists(path)) {
+            return Rewrite(target, shapes);
+        }
+        if (!pending.bytes.empty()) {
+            std::ofstream file(path.fn_str(), std::ios::binary | std::ios::app);
+            file.write(reinterpret_cast<const char*>(pending.bytes.data()), pending.bytes.size());
+            if (!file) {
+                return false;
+            }
+        }
+        fileLength += pending.bytes.size();
+        fileRecords += pendingRecords;
+        pending.bytes.clear();
+        pendingRecords = 0;
+        return true;
+    }
+
+    // Replace the file with one add record per live shape, dropping undone history
+    bool Rewrite(const wxString& target, const std::vector<Shape*>& shapes) {
+        ShapeWriter out;
+        WriteHeader(out);
+        for (Shape* shape : shapes) {
+            out.WriteByte(RECORD_ADD);
+            shape->Write(out);
+        }
+        return Replace(target, out, shapes.size());
+    }
+
+    static void WriteHeader(ShapeWriter& out) {
+        out.WriteInt(documentMagic);
+        out.WriteInt(documentVersion);
+    }
+
+    // Replace the file with a document serialized elsewhere: the header and one add record per shape
+    bool Replace(const wxString& target, const ShapeWriter& out, size_t records) {
+        wxString temp = target + ".tmp"; // Renamed over the target so a failed write keeps the old file
+        {
+            std::ofstream file(temp.fn_str(), std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(out.bytes.data()), out.bytes.size());
+            if (!file) {
+                return false;
+            }
+        }
+        if (!wxRenameFile(temp, target, true)) {
+            return false;
+        }
+        path = target;
+        pending.bytes.clear();
+        pendingRecords = 0;
+        fileRecords = records;
+        fileLength = out.bytes.size();
+        return true;
+    }
+
+    enum { loadChunkSize = 4 * 1024 * 1024 }; // Bytes of the file read at a time while loading
+
+    // Open a document file for replay by ContinueLoad, which reads it a chunk at a time, so only the
+    // header is read here; the journal takes the file's path at once
+    bool StartLoad(const wxString& source) {
+        std::ifstream file(source.fn_str(), std::ios::binary | std::ios::ate);
+        std::streamoff length = file.tellg();
+        file.seekg(0);
+        unsigned char header[8];
+        if (!file || !file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            return false;
+        }
+        ShapeReader in(header, sizeof(header));
+        if (static_cast<unsigned int>(in.ReadInt()) != documentMagic || in.ReadInt() > documentVersion || !in.IsOk()) {
+            return false;
+        }
+        ++edits;
+        path = source;
+        pending.bytes.clear();
+        pendingRecords = 0;
+        fileRecords = 0;
+        fileLength = static_cast<size_t>(length);
+        loadFile = std::move(file);
+        loading.clear();
+        loadPosition = 0;
+        return true;
+    }
+
+    bool IsLoading() const {
+        return loadFile.is_open();
+    }
+
+    // Replay records for about budget milliseconds, or all that remain when budget is negative. New
+    // shapes are appended to added; removals reaching past them are counted in removed, for the caller
+    // to take from the shapes it already holds before adding. A damaged tail keeps everything before
+    // it. Returns true while records remain
+    bool ContinueLoad(long budget, std::vector<Shape*>& added, int& removed) {
+        wxStopWatch watch;
+        bool more = true;
+        for (size_t step = 0; more; ++step) {
+            if (budget >= 0 && step % 64 == 63 && watch.Time() >= budget) {
+                break;
+            }
+            if (loadPosition == loading.size() && !ReadChunk()) {
+                more = false;
+                break;
+            }
+            ShapeReader in(loading.data() + loadPosition, loading.size() - loadPosition);
+            bool damaged = false;
+            unsigned char record = in.ReadByte();
+            if (record == RECORD_ADD) {
+                Shape* shape = ReadShape(in);
+                damaged = !shape;
+                if (shape) {
+                    added.push_back(shape);
+                }
+            }
+            else if (record == RECORD_REMOVE) {
+                int count = in.ReadInt();
+                damaged = !in.IsOk() || count < 0;
+                for (; !damaged && count > 0; --count) {
+                    if (added.empty()) {
+                        ++removed;
+                    }
+                    else {
+                        delete added.back();
+                        added.pop_back();
+                    }
+                }
+            }
+            else {
+                damaged = true;
+            }
+            if (!damaged) {
+                loadPosition += in.GetPosition();
+                ++fileRecords;
+            }
+            else if (in.IsOk() || !ReadChunk()) {
+                more = false; // Damaged, or cut short by the end of the file
+            }
+            // Otherwise the record runs on past what was read, and is read again with the next chunk
+        }
+        if (!more) {
+            loadFile.close();
+            std::vector<unsigned char>().swap(loading);
+            loadPosition = 0;
+        }
+        return more;
+    }
+
+private:
+    wxString path;       // File the document was last loaded from or saved to
+    ShapeWriter pending; // Records not yet in that file
+    size_t pendingRecords = 0;
+    size_t edits = 0;
+    size_t fileRecords = 0;
+    size_t fileLength = 0;
+    std::ifstream loadFile;             // Open while ContinueLoad works through it
+    std::vector<unsigned char> loading; // Read from it and not yet replayed from loadPosition on
+    size_t loadPosition = 0;
+
+    // Drop what has been replayed and append the next chunk of the file; false at its end
+    bool ReadChunk() {
+        loading.erase(loading.begin(), loading.begin() + loadPosition);
+        loadPosition = 0;
+        size_t kept = loading.size();
+        loading.resize(kept + loadChunkSize);
+        loadFile.read(reinterpret_cast<char*>(loading.data() + kept), loadChunkSize);
+        loading.resize(kept + static_cast<size_t>(loadFile.gcount()));
+        return loading.size() > kept;
+    }
+};
+
+// Stored shape reduced to what a thumbnail needs; reading it creates no GUI objects, so workers can
+struct ShapeGeometry {
+    ShapeType type = SHAPE_CIRCLE;
+    unsigned char color[3] = { 0, 0, 0 };
+    wxRect box;                  // Area covered, in document coordinates
+    std::vector<wxPoint> points; // Line ends, freehand points or polygon vertices
+    wxString imagePath;
+    wxImage image;               // Decoded by LoadImageGeometry
+};
+
+wxRect GetPointsBounds(const std::vector<wxPoint>& points) {
+    wxRect bounds;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i == 0) {
+            bounds = wxRect(points[i], wxSize(1, 1));
+        }
+        else {
+            bounds.Union(wxRect(points[i], wxSize(1, 1)));
+        }
+    }
+    return bounds;
+}
+
+// Mirrors the Read functions of the shape classes; returns false on unknown or damaged data
+bool ReadShapeGeometry(ShapeReader& in, ShapeGeometry& shape) {
+    shape.type = static_cast<ShapeType>(in.ReadByte());
+    bool colorFirst = shape.type == SHAPE_FREEHAND || shape.type == SHAPE_POLYGON;
+    if (colorFirst) {
+        for (unsigned char& channel : shape.color) {
+            channel = in.ReadByte();
+        }
+    }
+    switch (shape.type) {
+    case SHAPE_CIRCLE: {
+        wxPoint center = in.ReadPoint();
+        int radius = in.ReadInt();
+        shape.box = wxRect(center.x - radius, center.y - radius, 2 * radius + 1, 2 * radius + 1);
+        break;
+    }
+    case SHAPE_SQUARE: {
+        wxPoint topLeft = in.ReadPoint();
+        int side = in.ReadInt();
+        shape.box = wxRect(topLeft, wxSize(side, side));
+        break;
+    }
+    case SHAPE_ELLIPSE:
+    case SHAPE_RECTANGLE:
+        shape.box = in.ReadRect();
+        break;
+    case SHAPE_LINE:
+        shape.points.push_back(in.ReadPoint());
+        shape.points.push_back(in.ReadPoint());
+        shape.box = GetPointsBounds(shape.points);
+        break;
+    case SHAPE_FREEHAND:
+    case SHAPE_POLYGON:
+        shape.points = in.ReadPoints();
+        shape.box = GetPointsBounds(shape.points);
+        break;
+    case SHAPE_TEXT: {
+        wxPoint position = in.ReadPoint();
+        size_t length = in.ReadString().length();
+        in.ReadString(); // Font; text is greeked at thumbnail sizes
+        shape.box = wxRect(position, wxSize(9 * static_cast<int>(length), 20));
+        break;
+    }
+    case SHAPE_IMAGE:
+        shape.box = wxRect(in.ReadPoint(), wxSize(64, 64)); // Placeholder until decoded
+        shape.imagePath = in.ReadString();
+        return in.IsOk();
+    default:
+        return false;
+    }
+    if (!colorFirst) {
+        for (unsigned char& channel : shape.color) {
+            channel = in.ReadByte();
+        }
+    }
+    return in.IsOk();
+}
+
+void LoadImageGeometry(ShapeGeometry& shape) {
+    if (shape.type == SHAPE_IMAGE && shape.image.LoadFile(shape.imagePath) && shape.image.IsOk()) {
+        shape.box.SetSize(shape.image.GetSize());
+    }
+}
+
+// Geometry of the shapes a journal leaves; with appendOnly, fails at the first removal instead
+bool ReadJournalGeometry(ShapeReader& in, std::vector<ShapeGeometry>& shapes, bool appendOnly) {
+    while (!in.AtEnd()) {
+        unsigned char record = in.ReadByte();
+        if (record == RECORD_ADD) {
+            ShapeGeometry shape;
+            if (!ReadShapeGeometry(in, shape)) {
+                break;
+            }
+            shapes.push_back(std::move(shape));
+        }
+        else if (record == RECORD_REMOVE && !appendOnly) {
+            int count = in.ReadInt();
+            if (!in.IsOk() || count < 0) {
+                break;
+            }
+            shapes.resize(shapes.size() - std::min(shapes.size(), static_cast<size_t>(count)));
+        }
+        else {
+            return record != RECORD_REMOVE;
+        }
+    }
+    return true;
+}
+
+// RGB pixels drawn without wx GDI calls, so thumbnails can be rendered on worker threads
+class SoftRaster {
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> rgb;
+
+    SoftRaster() {}
+    SoftRaster(int width, int height)
+        : width(width), height(height), rgb(static_cast<size_t>(width) * height * 3, 255) {}
+
+    // Pixels whose centres lie in [left, right), never fewer than one so thin strokes survive
+    void FillSpan(int y, double left, double right, const unsigned char* color) {
+        if (y < 0 || y >= height) {
+            return;
+        }
+        int begin = Pixel(left);
+        int end = std::min(width, std::max(Pixel(right), begin + 1));
+        begin = std::max(begin, 0);
+        unsigned char* pixel = &rgb[(static_cast<size_t>(y) * width + begin) * 3];
+        for (int x = begin; x < end; ++x, pixel += 3) {
+            pixel[0] = color[0];
+            pixel[1] = color[1];
+            pixel[2] = color[2];
+        }
+    }
+
+    void FillRect(double left, double top, double right, double bottom, const unsigned char* color) {
+        int first = Pixel(top);
+        int last = std::max(Pixel(bottom), first + 1);
+        for (int y = std::max(first, 0); y < std::min(last, height); ++y) {
+            FillSpan(y, left, right, color);
+        }
+    }
+
+    void FillEllipse(double left, double top, double right, double bottom, const unsigned char* color) {
+        double cx = (left + right) / 2, cy = (top + bottom) / 2;
+        double rx = (right - left) / 2, ry = std::max((bottom - top) / 2, 0.5);
+        int first = Pixel(top);
+        int last = std::max(Pixel(bottom), first + 1);
+        for (int y = std::max(first, 0); y < std::min(last, height); ++y) {
+            double dy = (y + 0.5 - cy) / ry;
+            double half = rx * std::sqrt(std::max(0.0, 1 - dy * dy));
+            FillSpan(y, cx - half, cx + half, color);
+        }
+    }
+
+    // Even-odd scanline fill
+    void FillPolygon(const std::vector<double>& xs, const std::vector<double>& ys, const unsigned char* color) {
+        double top = *std::min_element(ys.begin(), ys.end());
+        double bottom = *std::max_element(ys.begin(), ys.end());
+        std::vector<double> crossings;
+        for (int y = std::max(Pixel(top), 0); y < std::min(Pixel(bottom) + 1, height); ++y) {
+            double centre = y + 0.5;
+            crossings.clear();
+            for (size_t i = 0, j = xs.size() - 1; i < xs.size(); j = i++) {
+                if ((ys[i] <= centre) != (ys[j] <= centre)) {
+                    crossings.push_back(xs[i] + (centre - ys[i]) * (xs[j] - xs[i]) / (ys[j] - ys[i]));
+                }
+            }
+            std::sort(crossings.begin(), crossings.end());
+            for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+                FillSpan(y, crossings[i], crossings[i + 1], color);
+            }
+        }
+    }
+
+    // Square stamps along the segment, one per pixel step
+    void DrawLine(double x0, double y0, double x1, double y1, double width, const unsigned char* color) {
+        int steps = std::max(1, static_cast<int>(std::ceil(std::max(std::fabs(x1 - x0), std::fabs(y1 - y0)))));
+        double half = width / 2;
+        for (int i = 0; i <= steps; ++i) {
+            double x = x0 + (x1 - x0) * i / steps, y = y0 + (y1 - y0) * i / steps;
+            FillRect(x - half, y - half, x + half, y + half, color);
+        }
+    }
+
+    void DrawImage(const wxImage& image, int left, int top) {
+        const unsigned char* source = image.GetData();
+        const unsigned char* alpha = image.HasAlpha() ? image.GetAlpha() : nullptr;
+        for (int y = std::max(0, -top); y < image.GetHeight() && top + y < height; ++y) {
+            for (int x = std::max(0, -left); x < image.GetWidth() && left + x < width; ++x) {
+                size_t from = static_cast<size_t>(y) * image.GetWidth() + x;
+                unsigned char* pixel = &rgb[(static_cast<size_t>(top + y) * width + left + x) * 3];
+                int opacity = alpha ? alpha[from] : 255;
+                for (int c = 0; c < 3; ++c) {
+                    pixel[c] = static_cast<unsigned char>((source[from * 3 + c] * opacity + pixel[c] * (255 - opacity)) / 255);
+                }
+            }
+        }
+    }
+
+    // Half size, each pixel the average of a 2x2 block; odd edges repeat their last pixel
+    SoftRaster Downsample() const {
+        SoftRaster half(std::max(1, (width + 1) / 2), std::max(1, (height + 1) / 2));
+        for (int y = 0; y < half.height; ++y) {
+            int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int x = 0; x < half.width; ++x) {
+                int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for (int c = 0; c < 3; ++c) {
+                    int sum = rgb[(y0 * width + x0) * 3 + c] + rgb[(y0 * width + x1) * 3 + c] +
+                              rgb[(y1 * width + x0) * 3 + c] + rgb[(y1 * width + x1) * 3 + c];
+                    half.rgb[(y * half.width + x) * 3 + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        return half;
+    }
+
+    wxImage ToImage() const {
+        wxImage image(width, height, false);
+        std::copy(rgb.begin(), rgb.end(), image.GetData());
+        return image;
+    }
+
+private:
+    static int Pixel(double coordinate) {
+        return static_cast<int>(std::floor(coordinate + 0.5));
+    }
+};
+
+// Maps document coordinates onto thumbnail pixels
+struct ThumbnailView {
+    int left = 0;
+    int top = 0;
+    double scale = 1;
+
+    double X(int x) const {
+        return (x - left) * scale;
+    }
+
+    double Y(int y) const {
+        return (y - top) * scale;
+    }
+};
+
+// Draw one shape at thumbnail scale; detail smaller than a pixel is skipped. Returns whether it drew
+bool RasterizeShape(const ShapeGeometry& shape, const ThumbnailView& view, SoftRaster& raster) {
+    const wxRect& box = shape.box;
+    double left = view.X(box.x), top = view.Y(box.y);
+    double right = view.X(box.x + box.width), bottom = view.Y(box.y + box.height);
+    if (right - left < 0.5 && bottom - top < 0.5) {
+        return false;
+    }
+    double stroke = std::max(1.0, 2 * view.scale);
+    switch (shape.type) {
+    case SHAPE_CIRCLE:
+    case SHAPE_ELLIPSE:
+        raster.FillEllipse(left, top, right, bottom, shape.color);
+        break;
+    case SHAPE_SQUARE:
+    case SHAPE_RECTANGLE:
+        raster.FillRect(left, top, right, bottom, shape.color);
+        break;
+    case SHAPE_LINE:
+    case SHAPE_FREEHAND: {
+        // Points closer than a pixel to the last one drawn add nothing at this size
+        const std::vector<wxPoint>& points = shape.points;
+        if (points.empty()) {
+            break;
+        }
+        double lastX = view.X(points[0].x), lastY = view.Y(points[0].y);
+        for (size_t i = 1; i < points.size(); ++i) {
+            double x = view.X(points[i].x), y = view.Y(points[i].y);
+            if (std::fabs(x - lastX) >= 1 || std::fabs(y - lastY) >= 1 || i + 1 == points.size()) {
+                raster.DrawLine(lastX, lastY, x, y, stroke, shape.color);
+                lastX = x;
+                lastY = y;
+            }
+        }
+        break;
+    }
+    case SHAPE_POLYGON: {
+        std::vector<double> xs, ys;
+        for (const wxPoint& point : shape.points) {
+            xs.push_back(view.X(point.x));
+            ys.push_back(view.Y(point.y));
+        }
+        if (xs.size() > 2) {
+            raster.FillPolygon(xs, ys, shape.color);
+        }
+        break;
+    }
+    case SHAPE_TEXT: {
+        // Greeked: a bar where the text runs
+        double middle = (top + bottom) / 2, thickness = (bottom - top) * 0.3;
+        raster.FillRect(left, middle - thickness, right, middle + thickness, shape.color);
+        break;
+    }
+    case SHAPE_IMAGE:
+        if (shape.image.IsOk()) {
+            int width = std::max(1, static_cast<int>(std::lround(right - left)));
+            int height = std::max(1, static_cast<int>(std::lround(bottom - top)));
+            raster.DrawImage(shape.image.Scale(width, height, wxIMAGE_QUALITY_BOX_AVERAGE),
+                             static_cast<int>(std::lround(left)), static_cast<int>(std::lround(top)));
+        }
+        else {
+            const unsigned char gray[3] = { 192, 192, 192 };
+            raster.FillRect(left, top, right, bottom, gray);
+        }
+        break;
+    }
+    return true;
+}
+
+const unsigned int thumbnailMagic = 0x54544e50; // "PNTT"
+const int thumbnailVersion = 2;
+
+// A document's thumbnail: rendered at supersample times the largest level, then box filtered
+struct Thumbnail {
+    enum { size = 256, supersample = 2, levelCount = 3 };
+
+    std::vector<SoftRaster> levels; // size, size/2, size/4 on the longest side
+    int drawnShapes = 0;            // Only the journal tail when incremental
+    bool incremental = false;
+    long milliseconds = 0;
+
+    // Smallest level still at least pixels on its longest side
+    const SoftRaster& GetLevel(int pixels) const {
+        size_t index = 0;
+        while (index + 1 < levels.size() && std::max(levels[index + 1].width, levels[index + 1].height) >= pixels) {
+            ++index;
+        }
+        return levels[index];
+    }
+};
+
+// FNV-1a; identifies the journal prefix a cached thumbnail was rendered from
+unsigned int HashBytes(const unsigned char* data, size_t size) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The supersampled render is cached next to the document with the length and hash of the journal
+// it covers; a compacted or replaced journal no longer matches and is rendered from scratch
+bool ReadThumbnailCache(const wxString& path, ThumbnailView& view, SoftRaster& raster, size_t& journalLength,
+                        unsigned int& journalHash) {
+    std::vector<unsigned char> bytes;
+    if (!ReadFileBytes(path, bytes)) {
+        return false;
+    }
+    ShapeReader in(bytes.data(), bytes.size());
+    if (static_cast<unsigned int>(in.ReadInt()) != thumbnailMagic || in.ReadInt() != thumbnailVersion) {
+        return false;
+    }
+    journalLength = static_cast<unsigned int>(in.ReadInt());
+    journalHash = static_cast<unsigned int>(in.ReadInt());
+    view.left = in.ReadInt();
+    view.top = in.ReadInt();
+    view.scale = in.ReadInt() / 1e6;
+    int width = in.ReadInt();
+    int height = in.ReadInt();
+    if (!in.IsOk() || width <= 0 || height <= 0 || view.scale <= 0 ||
+        bytes.size() - in.GetPosition() != static_cast<size_t>(width) * height * 3) {
+        return false;
+    }
+    raster = SoftRaster(width, height);
+    std::copy(bytes.begin() + in.GetPosition(), bytes.end(), raster.rgb.begin());
+    return true;
+}
+
+void WriteThumbnailCache(const wxString& path, const ThumbnailView& view, const SoftRaster& raster, size_t journalLength,
+                         unsigned int journalHash) {
+    ShapeWriter out;
+    out.WriteInt(thumbnailMagic);
+    out.WriteInt(thumbnailVersion);
+    out.WriteInt(static_cast<int>(journalLength));
+    out.WriteInt(static_cast<int>(journalHash));
+    out.WriteInt(view.left);
+    out.WriteInt(view.top);
+    out.WriteInt(static_cast<int>(std::lround(view.scale * 1e6)));
+    out.WriteInt(raster.width);
+    out.WriteInt(raster.height);
+    // Per-thread temporary name: two jobs may refresh the same thumbnail at once
+    wxString temp = wxString::Format("%s.%lu.tmp", path,
+        static_cast<unsigned long>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+    {
+        std::ofstream file(temp.fn_str(), std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(out.bytes.data()), out.bytes.size());
+        file.write(reinterpret_cast<const char*>(raster.rgb.data()), raster.rgb.size());
+        if (!file) {
+            file.close();
+            wxRemoveFile(temp);
+            return;
+        }
+    }
+    wxRenameFile(temp, path, true);
+}
+
+// Runs on a worker. Reuses the cached render when the journal only grew by shapes inside its frame
+bool GenerateThumbnail(const wxString& documentPath, Thumbnail& thumbnail) {
+    wxStopWatch watch;
+    std::vector<unsigned char> document;
+    if (!ReadFileBytes(documentPath, document)) {
+        return false;
+    }
+    ShapeReader in(document.data(), document.size());
+    if (static_cast<unsigned int>(in.ReadInt()) != documentMagic || in.ReadInt() > documentVersion || !in.IsOk()) {
+        return false;
+    }
+    size_t headerLength = in.GetPosition();
+
+    wxString cachePath = documentPath + ".thumb";
+    ThumbnailView view;
+    SoftRaster raster;
+    size_t cachedLength = 0;
+    unsigned int cachedHash = 0;
+    std::vector<ShapeGeometry> shapes;
+    if (ReadThumbnailCache(cachePath, view, raster, cachedLength, cachedHash) &&
+        cachedLength >= headerLength && cachedLength <= document.size() &&
+        HashBytes(document.data(), cachedLength) == cachedHash) {
+        ShapeReader tail(document.data() + cachedLength, document.size() - cachedLength);
+        thumbnail.incremental = ReadJournalGeometry(tail, shapes, true);
+        wxRect frame(view.left, view.top, static_cast<int>(std::ceil(raster.width / view.scale)),
+                     static_cast<int>(std::ceil(raster.height / view.scale)));
+        for (ShapeGeometry& shape : shapes) {
+            LoadImageGeometry(shape);
+            thumbnail.incremental = thumbnail.incremental && frame.Contains(shape.box);
+        }
+    }
+    if (!thumbnail.incremental) {
+        shapes.clear();
+        ReadJournalGeometry(in, shapes, false);
+        wxRect bounds;
+        for (ShapeGeometry& shape : shapes) {
+            LoadImageGeometry(shape);
+            bounds.Union(shape.box);
+        }
+        bounds.Inflate(2);
+        int pixels = Thumbnail::size * Thumbnail::supersample;
+        view.left = bounds.x;
+        view.top = bounds.y;
+        view.scale = std::min(static_cast<double>(Thumbnail::supersample),
+                              std::min(static_cast<double>(pixels) / bounds.width, static_cast<double>(pixels) / bounds.height));
+        raster = SoftRaster(std::max(1, static_cast<int>(std::ceil(bounds.width * view.scale))),
+                            std::max(1, static_cast<int>(std::ceil(bounds.height * view.scale))));
+    }
+    for (const ShapeGeometry& shape : shapes) {
+        if (RasterizeShape(shape, view, raster)) {
+            ++thumbnail.drawnShapes;
+        }
+    }
+    if (!thumbnail.incremental || cachedLength != document.size()) {
+        WriteThumbnailCache(cachePath, view, raster, document.size(), HashBytes(document.data(), document.size()));
+    }
+
+    thumbnail.levels.clear();
+    thumbnail.levels.push_back(raster.Downsample());
+    while (static_cast<int>(thumbnail.levels.size()) < Thumbnail::levelCount) {
+        thumbnail.levels.push_back(thumbnail.levels.back().Downsample());
+    }
+    thumbnail.milliseconds = watch.Time();
+    return true;
+}
+
+// Graphics renderer for batched drawing: cairo where wx was built with it, else the platform default
+inline wxGraphicsRenderer* GetBatchRenderer() {
+    wxGraphicsRenderer* cairo = wxGraphicsRenderer::GetCairoRenderer();
+    return cairo ? cairo : wxGraphicsRenderer::GetDefaultRenderer();
+}
+
+// Draws shapes as one wxGraphicsPath per batch of same-styled shapes, so a tile costs a handful of
+// fill and stroke calls instead of one DC call per shape. Paint order is kept: a shape joins an
+// earlier batch only if nothing added since overlaps it, and a filled shape never joins a batch it
+// overlaps, since outlines and fills must stack as they would when drawn one at a time
+class PathBatcher {
+public:
+    enum { lookback = 8 }; // Batches searched for a matching style before starting a new one
+
+    explicit PathBatcher(wxGCDC& dc) : dc(dc) {}
+
+    void Add(Shape* shape) {
+        PathStyle style = shape->GetPathStyle();
+        wxRect bounds = shape->GetBounds();
+        Batch* target = nullptr;
+        if (style.kind != PathStyle::none) {
+            for (size_t i = batches.size(), searched = 0; i > 0 && searched < lookback; --i, ++searched) {
+                Batch& batch = batches[i - 1];
+                bool overlaps = batch.Overlaps(bounds);
+                if (batch.style == style && !(overlaps && style.kind == PathStyle::fill)) {
+                    target = &batch;
+                    break;
+                }
+                if (overlaps) {
+                    break;
+                }
+            }
+        }
+        if (!target) {
+            batches.emplace_back();
+            target = &batches.back();
+            target->style = style;
+            if (style.kind == PathStyle::none) {
+                target->shape = shape;
+            }
+            else {
+                target->path = dc.GetGraphicsContext()->CreatePath();
+            }
+        }
+        if (style.kind != PathStyle::none) {
+            shape->AddToPath(target->path);
+        }
+        target->Include(bounds);
+    }
+
+    // Draw every batch in order; pens and brushes go through the DC so shapes drawn on their own see them
+    void Flush() {
+        wxGraphicsContext* context = dc.GetGraphicsContext();
+        for (Batch& batch : batches) {
+            switch (batch.style.kind) {
+            case PathStyle::fill:
+                UseFillStyle(dc, batch.style.color);
+                context->DrawPath(batch.path);
+                break;
+            case PathStyle::stroke:
+                UseStrokeStyle(dc, batch.style.color, batch.style.width);
+                context->StrokePath(batch.path);
+                break;
+            default:
+                batch.shape->Draw(dc);
+                break;
+            }
+        }
+        drawCalls += batches.size();
+        batches.clear();
+    }
+
+    size_t GetDrawCalls() const {
+        return drawCalls;
+    }
+
+private:
+    struct Batch {
+        PathStyle style;
+        wxGraphicsPath path;
+        Shape* shape = nullptr; // Drawn through Draw() when the style is none
+        wxRect area; // Union of members, for a quick rejection before checking each one
+        std::vector<wxRect> members;
+
+        void Include(const wxRect& bounds) {
+            area = members.empty() ? bounds : area.Union(bounds);
+            members.push_back(bounds);
+        }
+
+        bool Overlaps(const wxRect& bounds) const {
+            if (!area.Intersects(bounds)) {
+                return false;
+            }
+            for (const wxRect& member : members) {
+                if (member.Intersects(bounds)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    wxGCDC& dc;
+    std::vector<Batch> batches;
+    size_t drawCalls = 0;
+};
+
+// Division rounding towards negative infinity, for tile coordinates left of or above the origin
+inline int FloorDiv(int value, int divisor) {
+    return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+// Position along a Hilbert curve over document space in 16 px steps; points close on the curve are
+// close on the page
+inline unsigned HilbertKey(int x, int y) {
+    const unsigned side = 1u << 16; // Centred on the origin, clamped beyond about half a million pixels
+    const int centre = static_cast<int>(side / 2);
+    unsigned hx = static_cast<unsigned>(std::max(0, std::min(FloorDiv(x, 16) + centre, 2 * centre - 1)));
+    unsigned hy = static_cast<unsigned>(std::max(0, std::min(FloorDiv(y, 16) + centre, 2 * centre - 1)));
+    unsigned key = 0;
+    for (unsigned half = side / 2; half > 0; half /= 2) {
+        unsigned rx = (hx & half) ? 1 : 0;
+        unsigned ry = (hy & half) ? 1 : 0;
+        key += half * half * ((3 * rx) ^ ry);
+        if (ry == 0) { // Rotate the quadrant so the curve stays continuous
+            if (rx == 1) {
+                hx = side - 1 - hx;
+                hy = side - 1 - hy;
+            }
+            std::swap(hx, hy);
+        }
+    }
+    return key;
+}
+
+// Shapes bucketed by the canvas tiles their bounds touch, each bucket in document order
+class ShapeGrid {
+public:
+    enum { cellSize = 256 };
+
+    struct Entry {
+        size_t order; // Increases with every add, so merged buckets sort back into document order
+        Shape* shape;
+        bool hidden; // Within this cell, entirely under the opaque area of a later shape
+    };
+
+    // Earlier entries the new shape covers within each cell are marked hidden
+    void Add(Shape* shape) {
+        wxRect bounds = shape->GetBounds();
+        wxRect opaque = shape->GetOpaqueArea();
+        for (int row = FloorDiv(bounds.y, cellSize); row <= FloorDiv(bounds.GetBottom(), cellSize); ++row) {
+            for (int column = FloorDiv(bounds.x, cellSize); column <= FloorDiv(bounds.GetRight(), cellSize); ++column) {
+                std::vector<Entry>& cell = buckets[Key(column, row)];
+                if (!opaque.IsEmpty()) {
+                    wxRect area = GetCellRect(column, row);
+                    for (Entry& entry : cell) {
+                        if (!entry.hidden && opaque.Contains(entry.shape->GetBounds().Intersect(area))) {
+                            entry.hidden = true;
+                            ++hiddenCount;
+                        }
+                    }
+                }
+                cell.push_back(Entry{ nextOrder, shape, false });
+            }
+        }
+        ++nextOrder;
+    }
+
+    // Bulk insertion for loading and large batches. Cell entries are generated and sorted by cell in
+    // parallel, appended to their buckets in one pass, and only cells that gained an opaque shape
+    // have their occlusion recomputed, also in parallel, or later through UpdateStaleOcclusion.
+    // Until then the new shapes hide nothing, which is always safe
+    void AddAll(const std::vector<Shape*>& added, bool deferOcclusion = false) {
+        struct Placed {
+            long long key;
+            size_t order;
+            Shape* shape;
+            bool opaque;
+        };
+        std::vector<std::vector<Placed>> parts(ParallelChunks(added.size()));
+        size_t firstOrder = nextOrder;
+        ParallelFor(added.size(), [&](size_t chunk, size_t begin, size_t end) {
+            std::vector<Placed>& placed = parts[chunk];
+            placed.reserve(end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                wxRect bounds = added[i]->GetBounds();
+                bool opaque = !added[i]->GetOpaqueArea().IsEmpty();
+                for (int row = FloorDiv(bounds.y, cellSize); row <= FloorDiv(bounds.GetBottom(), cellSize); ++row) {
+                    for (int column = FloorDiv(bounds.x, cellSize); column <= FloorDiv(bounds.GetRight(), cellSize); ++column) {
+                        placed.push_back(Placed{ Key(column, row), firstOrder + i, added[i], opaque });
+                    }
+                }
+            }
+        });
+        nextOrder += added.size();
+        std::vector<Placed> all;
+        for (std::vector<Placed>& part : parts) {
+            all.insert(all.end(), part.begin(), part.end());
+            std::vector<Placed>().swap(part);
+        }
+        ParallelSort(all, [](const Placed& a, const Placed& b) { return a.key != b.key ? a.key < b.key : a.order < b.order; });
+
+        std::vector<std::pair<long long, std::vector<Entry>*>> occluded;
+        buckets.reserve(buckets.size() + all.size() / 8);
+        for (size_t first = 0; first < all.size();) {
+            size_t last = first;
+            bool opaque = false;
+            while (last < all.size() && all[last].key == all[first].key) {
+                opaque = opaque || all[last].opaque;
+                ++last;
+            }
+            std::vector<Entry>& cell = buckets[all[first].key];
+            cell.reserve(cell.size() + last - first);
+            for (size_t i = first; i < last; ++i) {
+                cell.push_back(Entry{ all[i].order, all[i].shape, false });
+            }
+            if (opaque) {
+                occluded.emplace_back(all[first].key, &cell); // unordered_map keeps element addresses through rehashing
+            }
+            first = last;
+        }
+        if (deferOcclusion) {
+            for (const auto& cell : occluded) {
+                staleCells.push_back(cell.first);
+            }
+            return;
+        }
+        std::vector<size_t> changes(ParallelChunks(occluded.size()), 0);
+        ParallelFor(occluded.size(), [&](size_t chunk, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                long long key = occluded[i].first;
+                wxRect area = GetCellRect(static_cast<int>(key >> 32), static_cast<int>(static_cast<unsigned>(key)));
+                changes[chunk] += UpdateOcclusion(*occluded[i].second, area);
+            }
+        });
+        for (size_t change : changes) {
+            hiddenCount += change;
+        }
+    }
+
+    // Undo takes shapes away newest first, so each one is last in its buckets
+    void RemoveNewest(Shape* shape) {
+        wxRect bounds = shape->GetBounds();
+        for (int row = FloorDiv(bounds.y, cellSize); row <= FloorDiv(bounds.GetBottom(), cellSize); ++row) {
+            for (int column = FloorDiv(bounds.x, cellSize); column <= FloorDiv(bounds.GetRight(), cellSize); ++column) {
+                auto found = buckets.find(Key(column, row));
+                if (found != buckets.end() && !found->second.empty() && found->second.back().shape == shape) {
+                    found->second.pop_back();
+                    if (found->second.empty()) {
+                        buckets.erase(found);
+                    }
+                    else if (!shape->GetOpaqueArea().IsEmpty()) {
+                        hiddenCount += UpdateOcclusion(found->second, GetCellRect(column, row)); // What it covered may show again
+                    }
+                }
+            }
+        }
+    }
+
+    // A shape whose bounds changed in place from before, such as an image that was a placeholder
+    // until decoded, keeps its place in document order. Its entries start visible, and the cells
+    // it now covers have their occlusion recomputed in idle time. Shapes not in the grid are left out
+    void Rebucket(Shape* shape, const wxRect& before) {
+        wxRect bounds = shape->GetBounds();
+        wxRect touched = before.Union(bounds);
+        size_t order = 0;
+        bool found = false;
+        for (int row = FloorDiv(touched.y, cellSize); row <= FloorDiv(touched.GetBottom(), cellSize); ++row) {
+            for (int column = FloorDiv(touched.x, cellSize); column <= FloorDiv(touched.GetRight(), cellSize); ++column) {
+                auto bucket = buckets.find(Key(column, row));
+                if (bucket == buckets.end()) {
+                    continue;
+                }
+                std::vector<Entry>& cell = bucket->second;
+                auto entry = std::find_if(cell.begin(), cell.end(), [shape](const Entry& candidate) { return candidate.shape == shape; });
+                if (entry != cell.end()) {
+                    order = entry->order;
+                    found = true;
+                    hiddenCount -= entry->hidden ? 1 : 0;
+                    cell.erase(entry);
+                    if (cell.empty()) {
+                        buckets.erase(bucket);
+                    }
+                }
+            }
+        }
+        if (!found) {
+            return;
+        }
+        for (int row = FloorDiv(bounds.y, cellSize); row <= FloorDiv(bounds.GetBottom(), cellSize); ++row) {
+            for (int column = FloorDiv(bounds.x, cellSize); column <= FloorDiv(bounds.GetRight(), cellSize); ++column) {
+                std::vector<Entry>& cell = buckets[Key(column, row)];
+                auto position = std::upper_bound(cell.begin(), cell.end(), order, [](size_t order, const Entry& entry) { return order < entry.order; });
+                cell.insert(position, Entry{ order, shape, false });
+                staleCells.push_back(Key(column, row));
+            }
+        }
+    }
+
+    // Undo of a bulk insertion: the shapes are the newest ones, so each cell loses entries from its
+    // end only. Cells that keep entries and lost an opaque shape have their occlusion recomputed
+    // later through UpdateStaleOcclusion, so a large batch never rescans a cell once per shape
+    void RemoveNewestAll(const std::vector<Shape*>& removed) {
+        std::unordered_set<Shape*> taken(removed.begin(), removed.end());
+        for (Shape* shape : removed) {
+            wxRect bounds = shape->GetBounds();
+            for (int row = FloorDiv(bounds.y, cellSize); row <= FloorDiv(bounds.GetBottom(), cellSize); ++row) {
+                for (int column = FloorDiv(bounds.x, cellSize); column <= FloorDiv(bounds.GetRight(), cellSize); ++column) {
+                    auto found = buckets.find(Key(column, row));
+                    if (found == buckets.end()) {
+                        continue; // Emptied by an earlier shape of the batch
+                    }
+                    std::vector<Entry>& cell = found->second;
+                    bool opaque = false;
+                    while (!cell.empty() && taken.count(cell.back().shape)) {
+                        opaque = opaque || !cell.back().shape->GetOpaqueArea().IsEmpty();
+                        hiddenCount -= cell.back().hidden ? 1 : 0;
+                        cell.pop_back();
+                    }
+                    if (cell.empty()) {
+                        buckets.erase(found);
+                    }
+                    else if (opaque) {
+                        staleCells.push_back(found->first);
+                    }
+                }
+            }
+        }
+    }
+
+    void Clear() {
+        buckets.clear();
+        staleCells.clear();
+        hiddenCount = 0;
+    }
+
+    // Work through cells whose occlusion AddAll deferred, for about budget milliseconds; true while more remain
+    bool UpdateStaleOcclusion(long budget) {
+        wxStopWatch watch;
+        while (!staleCells.empty() && watch.Time() < budget) {
+            long long key = staleCells.back();
+            staleCells.pop_back();
+            auto found = buckets.find(key);
+            if (found != buckets.end()) {
+                hiddenCount += UpdateOcclusion(found->second, GetCellRect(static_cast<int>(key >> 32), static_cast<int>(static_cast<unsigned>(key))));
+            }
+        }
+        return !staleCells.empty();
+    }
+
+    template <typename Visit>
+    void ForEachCell(Visit visit) const {
+        for (const auto& bucket : buckets) {
+            visit(bucket.second);
+        }
+    }
+
+    // Cell entries hidden by occlusion, summed over all cells
+    size_t GetHiddenCount() const {
+        return hiddenCount;
+    }
+
+    static wxRect GetCellRect(int column, int row) {
+        return wxRect(column * cellSize, row * cellSize, cellSize, cellSize);
+    }
+
+    const std::vector<Entry>* GetCell(int column, int row) const {
+        auto found = buckets.find(Key(column, row));
+        return found == buckets.end() ? nullptr : &found->second;
+    }
+
+    // Shapes whose bounds touch rect, in document order
+    std::vector<Shape*> Query(const wxRect& rect) const {
+        std::vector<Entry> found;
+        for (int row = FloorDiv(rect.y, cellSize); row <= FloorDiv(rect.GetBottom(), cellSize); ++row) {
+            for (int column = FloorDiv(rect.x, cellSize); column <= FloorDiv(rect.GetRight(), cellSize); ++column) {
+                if (const std::vector<Entry>* cell = GetCell(column, row)) {
+                    for (const Entry& entry : *cell) {
+                        if (entry.shape->GetBounds().Intersects(rect)) {
+                            found.push_back(entry);
+                        }
+                    }
+                }
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.order < b.order; });
+        std::vector<Shape*> shapes;
+        for (size_t i = 0; i < found.size(); ++i) {
+            if (i == 0 || found[i].order != found[i - 1].order) {
+                shapes.push_back(found[i].shape);
+            }
+        }
+        return shapes;
+    }
+
+private:
+    std::unordered_map<long long, std::vector<Entry>> buckets;
+    std::vector<long long> staleCells; // Keys of cells whose occlusion AddAll left for later
+    size_t nextOrder = 0;
+    size_t hiddenCount = 0;
+
+    static long long Key(int column, int row) {
+        return (static_cast<long long>(column) << 32) | static_cast<unsigned>(row);
+    }
+
+    // Mark the cell's entries again from its newest entry back, against later opaque areas; only
+    // the newest occluders are kept, which can miss some but never hides a visible shape. Returns
+    // the change in hidden entries, so cells can be updated in parallel
+    static size_t UpdateOcclusion(std::vector<Entry>& cell, const wxRect& area) {
+        const size_t occluderLimit = 64;
+        std::vector<wxRect> occluders;
+        size_t change = 0; // Wraps for a net decrease, which the caller's addition undoes
+        for (auto it = cell.rbegin(); it != cell.rend(); ++it) {
+            wxRect visible = it->shape->GetBounds().Intersect(area);
+            bool hidden = std::any_of(occluders.begin(), occluders.end(), [&](const wxRect& opaque) { return opaque.Contains(visible); });
+            if (hidden != it->hidden) {
+                change += hidden ? 1 : static_cast<size_t>(-1);
+                it->hidden = hidden;
+            }
+            wxRect opaque = it->shape->GetOpaqueArea().Intersect(area);
+            if (!hidden && !opaque.IsEmpty() && occluders.size() < occluderLimit) {
+                occluders.push_back(opaque);
+            }
+        }
+        return change;
+    }
+};
+
+// Committed shapes rendered in tiles of document space, least recently used dropped above memoryLimit.
+// Panning and resizing reuse them, so only tiles coming into view are drawn. Tiles are kept per
+// content scale (in percent), so a window moved to a screen of another density keeps the old tiles
+// to show until each one is drawn again at the new scale
+class CanvasTileCache {
+public:
+    enum { tileSize = ShapeGrid::cellSize };
+
+    CanvasTileCache() {
+        registryId = GetCacheRegistry().Register("Document tiles", CacheRegistry::PRIORITY_TILES,
+                                                 [this] { return memoryBytes; }, [this](size_t bytes) { return Shed(bytes); });
+    }
+
+    ~CanvasTileCache() {
+        GetCacheRegistry().Unregister(registryId);
+    }
+
+    CanvasTileCache(const CanvasTileCache&) = delete;
+    CanvasTileCache& operator=(const CanvasTileCache&) = delete;
+
+    // Tiles of documents off screen go before any glyphs or tiles in view
+    void SetHidden(bool hidden) {
+        GetCacheRegistry().SetPriority(registryId, hidden ? CacheRegistry::PRIORITY_HIDDEN_TILES : CacheRegistry::PRIORITY_TILES);
+    }
+
+    // Marks the tile recently used
+    wxBitmap* Find(int column, int row, int scale) {
+        auto found = FindEntry(column, row, scale);
+        if (!found) {
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, found->lruPosition);
+        return &found->bitmap;
+    }
+
+    // For updating a tile without keeping it alive
+    wxBitmap* Peek(int column, int row, int scale) {
+        Entry* found = FindEntry(column, row, scale);
+        return found ? &found->bitmap : nullptr;
+    }
+
+    // The tile at whatever other scale is cached, to stand in until it is drawn at the current one
+    wxBitmap* PeekOtherScale(int column, int row, int scale) {
+        for (auto& level : levels) {
+            if (level.first != scale) {
+                if (wxBitmap* bitmap = Peek(column, row, level.first)) {
+                    return bitmap;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Scales with cached tiles; edits are drawn into all of them
+    std::vector<int> GetScales() const {
+        std::vector<int> scales;
+        for (const auto& level : levels) {
+            scales.push_back(level.first);
+        }
+        return scales;
+    }
+
+    wxBitmap& Insert(int column, int row, int scale, const wxBitmap& bitmap) {
+        Slot slot(scale, Key(column, row));
+        Erase(slot);
+        shedSlots.erase(slot);
+        lru.push_front(slot);
+        Entry& entry = levels[scale][slot.second];
+        entry = Entry{ bitmap, lru.begin() };
+        memoryBytes += BitmapBytes(bitmap);
+        while (memoryBytes > memoryLimit && lru.size() > 1) {
+            Erase(lru.back());
+        }
+        return entry.bitmap;
+    }
+
+    void Clear() {
+        levels.clear();
+        lru.clear();
+        shedSlots.clear();
+        memoryBytes = 0;
+    }
+
+    // Drop tiles, least recently used first, until about bytes are freed; returns what was freed
+    size_t Shed(size_t bytes) {
+        size_t before = memoryBytes;
+        while (!lru.empty() && before - memoryBytes < bytes) {
+            shedSlots.insert(lru.back());
+            Erase(lru.back());
+        }
+        return before - memoryBytes;
+    }
+
+    // Whether the tile was dropped for memory, so drawing it again is a cost of shedding
+    bool WasShed(int column, int row, int scale) const {
+        return shedSlots.count(Slot(scale, Key(column, row))) != 0;
+    }
+
+    void NoteRebuild(long long microseconds) {
+        GetCacheRegistry().NoteRebuild(registryId, microseconds);
+    }
+
+    // visit(column, row, scale, bitmap) for every tile, most recently used first
+    template <typename Visit>
+    void ForEachRecent(Visit visit) const {
+        for (const Slot& slot : lru) {
+            const Entry& entry = levels.at(slot.first).at(slot.second);
+            visit(static_cast<int>(slot.second >> 32), static_cast<int>(static_cast<unsigned>(slot.second)), slot.first, entry.bitmap);
+        }
+    }
+
+    // Drop the tiles under rect at every scale, to be drawn again when next painted
+    void Invalidate(const wxRect& rect) {
+        std::vector<int> scales = GetScales();
+        for (int row = FloorDiv(rect.y, tileSize); row <= FloorDiv(rect.GetBottom(), tileSize); ++row) {
+            for (int column = FloorDiv(rect.x, tileSize); column <= FloorDiv(rect.GetRight(), tileSize); ++column) {
+                for (int scale : scales) {
+                    Erase(Slot(scale, Key(column, row)));
+                    shedSlots.erase(Slot(scale, Key(column, row))); // Drawn again for the edit, not for memory
+                }
+            }
+        }
+    }
+
+    size_t GetMemoryBytes() const {
+        return memoryBytes;
+    }
+
+    // Room for about three views of tiles; grows in coarse steps as the window grows and never
+    // shrinks, so live resizing does not reallocate or evict on every size event
+    void ReserveFor(const wxSize& view, int scale) {
+        size_t visible = static_cast<size_t>(view.x / tileSize + 2) * (view.y / tileSize + 2);
+        size_t tileBytes = static_cast<size_t>(tileSize * scale / 100) * (tileSize * scale / 100) * 4;
+        size_t step = 32 * 1024 * 1024;
+        size_t needed = (visible * 3 * tileBytes + step - 1) / step * step;
+        memoryLimit = std::max(memoryLimit, needed);
+    }
+
+    static wxRect GetTileRect(int column, int row) {
+        return wxRect(column * tileSize, row * tileSize, tileSize, tileSize);
+    }
+
+private:
+    typedef std::pair<int, long long> Slot; // Scale and position
+
+    struct Entry {
+        wxBitmap bitmap;
+        std::list<Slot>::iterator lruPosition;
+    };
+
+    std::map<int, std::unordered_map<long long, Entry>> levels;
+    std::list<Slot> lru;
+    std::set<Slot> shedSlots;
+    size_t memoryBytes = 0;
+    size_t memoryLimit = 64 * 1024 * 1024;
+    int registryId = 0;
+
+    static long long Key(int column, int row) {
+        return (static_cast<long long>(column) << 32) | static_cast<unsigned>(row);
+    }
+
+    static size_t BitmapBytes(const wxBitmap& bitmap) {
+        return static_cast<size_t>(bitmap.GetWidth()) * bitmap.GetHeight() * 4; // Device pixels
+    }
+
+    Entry* FindEntry(int column, int row, int scale) {
+        auto level = levels.find(scale);
+        if (level == levels.end()) {
+            return nullptr;
+        }
+        auto found = level->second.find(Key(column, row));
+        return found == level->second.end() ? nullptr : &found->second;
+    }
+
+    void Erase(const Slot& slot) {
+        auto level = levels.find(slot.first);
+        if (level == levels.end()) {
+            return;
+        }
+        auto found = level->second.find(slot.second);
+        if (found != level->second.end()) {
+            memoryBytes -= BitmapBytes(found->second.bitmap);
+            lru.erase(found->second.lruPosition);
+            level->second.erase(found);
+            if (level->second.empty()) {
+                levels.erase(level);
+            }
+        }
+    }
+};
+
+const unsigned int tilePackMagic = 0x43544e50; // "PNTC"
+const int tilePackVersion = 3;
+const size_t tilePackHeaderSize = 36; // Magic, version, backend, document length, modification time and hash
+const size_t tileRecordHeaderSize = 20; // Column, row, scale, width and height, ahead of the pixels
+
+// One rendered canvas tile as RGB bytes, on its way to or from a tile pack
+struct PackedTile {
+    int column = 0;
+    int row = 0;
+    int scale = 100;
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> rgb;
+};
+
+// Rendered canvas tiles kept next to a document (document.tiles), so reopening it paints from disk
+// instead of drawing every tile again. The pack names the length and modification time of the
+// document file it was rendered from, and the backend that drew it, and is ignored once they no
+// longer match; that takes no reading of the document, so the first frame can come from the pack.
+// The document's hash is stored too, for the opener to check once it has read the file off the UI
+// thread. Opening reads only the index; each tile is read when it is first needed
+class TilePack {
+public:
+    enum { sizeLimit = 96 * 1024 * 1024 }; // Bytes of pixels per document; the least recently used tiles are left out
+
+    bool IsOpen() const {
+        return file.is_open();
+    }
+
+    // Read the index of the pack at path if it was rendered from this document file by this backend
+    bool Open(const wxString& path, size_t documentLength, long long documentModified, bool batched) {
+        Close();
+        file.open(path.fn_str(), std::ios::binary);
+        std::vector<unsigned char> header;
+        if (!ReadBytes(tilePackHeaderSize, header)) {
+            Close();
+            return false;
+        }
+        ShapeReader in(header.data(), header.size());
+        if (static_cast<unsigned int>(in.ReadInt()) != tilePackMagic || in.ReadInt() != tilePackVersion ||
+            in.ReadInt() != static_cast<int>(batched) || ReadLong(in) != documentLength ||
+            static_cast<long long>(ReadLong(in)) != documentModified) {
+            Close();
+            return false;
+        }
+        documentHash = ReadLong(in);
+        // Records stop at the first damaged one, as a journal's do
+        while (ReadBytes(tileRecordHeaderSize, header)) {
+            ShapeReader record(header.data(), header.size());
+            Record entry;
+            int column = record.ReadInt();
+            int row = record.ReadInt();
+            entry.scale = record.ReadInt();
+            entry.width = record.ReadInt();
+            entry.height = record.ReadInt();
+            if (entry.scale <= 0 || entry.width <= 0 || entry.height <= 0 || entry.width > 4096 || entry.height > 4096) {
+                break;
+            }
+            entry.key = Key(column, row);
+            entry.offset = file.tellg();
+            file.seekg(static_cast<std::streamoff>(entry.width) * entry.height * 3, std::ios::cur);
+            index[Slot(entry.scale, entry.key)] = records.size();
+            records.push_back(entry);
+        }
+        file.clear();
+        return true;
+    }
+
+    void Close() {
+        file.close();
+        file.clear();
+        index.clear();
+        records.clear();
+    }
+
+    // Hash of the document file the open pack was rendered from, as HashDocument gives it
+    unsigned long long GetDocumentHash() const {
+        return documentHash;
+    }
+
+    // The stored tile as a bitmap at scale, if the pack has it
+    bool Load(int column, int row, int scale, wxBitmap& bitmap) {
+        auto found = index.find(Slot(scale, Key(column, row)));
+        PackedTile tile;
+        if (found == index.end() || !ReadTile(records[found->second], tile)) {
+            return false;
+        }
+        wxImage image(tile.width, tile.height, false);
+        std::copy(tile.rgb.begin(), tile.rgb.end(), image.GetData());
+        bitmap = wxBitmap(image);
+        bitmap.SetScaleFactor(scale / 100.0);
+        return true;
+    }
+
+    // visit(tile) for every stored tile, most recently used when the pack was written first
+    template <typename Visit>
+    void ForEach(Visit visit) {
+        for (const Record& record : records) {
+            PackedTile tile;
+            if (ReadTile(record, tile)) {
+                visit(tile);
+            }
+        }
+    }
+
+    // Runs on a worker after a save, or directly as a document closes. Replaced by rename, so a pack is never half written
+    static bool Write(const wxString& path, size_t documentLength, long long documentModified, unsigned long long documentHash,
+                      bool batched, const std::vector<PackedTile>& tiles) {
+        ShapeWriter out;
+        out.WriteInt(tilePackMagic);
+        out.WriteInt(tilePackVersion);
+        out.WriteInt(batched);
+        WriteLong(out, documentLength);
+        WriteLong(out, documentModified);
+        WriteLong(out, documentHash);
+        wxString temp = path + ".tmp";
+        {
+            std::ofstream file(temp.fn_str(), std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(out.bytes.data()), out.bytes.size());
+            for (const PackedTile& tile : tiles) {
+                out.bytes.clear();
+                out.WriteInt(tile.column);
+                out.WriteInt(tile.row);
+                out.WriteInt(tile.scale);
+                out.WriteInt(tile.width);
+                out.WriteInt(tile.height);
+                file.write(reinterpret_cast<const char*>(out.bytes.data()), out.bytes.size());
+                file.write(reinterpret_cast<const char*>(tile.rgb.data()), tile.rgb.size());
+            }
+            if (!file) {
+                file.close();
+                wxRemoveFile(temp);
+                return false;
+            }
+        }
+        return wxRenameFile(temp, path, true);
+    }
+
+    // Hash of the first length bytes of a document file, read a chunk at a time. Slow for large
+    // documents, so only on workers
+    static bool HashDocument(const wxString& path, size_t length, unsigned long long& hash) {
+        std::ifstream file(path.fn_str(), std::ios::binary);
+        std::vector<char> chunk(4 * 1024 * 1024);
+        hash = 0;
+        for (size_t done = 0; done < length;) {
+            size_t size = std::min(chunk.size(), length - done);
+            if (!file.read(chunk.data(), size)) {
+                return false;
+            }
+            hash = HashBytes64(chunk.data(), size, hash);
+            done += size;
+        }
+        return true;
+    }
+
+private:
+    typedef std::pair<int, long long> Slot; // Scale and position, as in CanvasTileCache
+
+    struct Record {
+        long long key = 0;
+        int scale = 0;
+        int width = 0;
+        int height = 0;
+        std::streampos offset; // Of the pixels
+    };
+
+    std::ifstream file;
+    std::vector<Record> records; // In file order
+    std::map<Slot, size_t> index;
+    unsigned long long documentHash = 0;
+
+    static long long Key(int column, int row) {
+        return (static_cast<long long>(column) << 32) | static_cast<unsigned>(row);
+    }
+
+    // 64-bit values as two ints, low half first
+    static void WriteLong(ShapeWriter& out, unsigned long long value) {
+        out.WriteInt(static_cast<int>(value));
+        out.WriteInt(static_cast<int>(value >> 32));
+    }
+
+    static unsigned long long ReadLong(ShapeReader& in) {
+        unsigned long long low = static_cast<unsigned int>(in.ReadInt());
+        return low | static_cast<unsigned long long>(static_cast<unsigned int>(in.ReadInt())) << 32;
+    }
+
+    bool ReadBytes(size_t count, std::vector<unsigned char>& bytes) {
+        bytes.resize(count);
+        return file.read(reinterpret_cast<char*>(bytes.data()), count) && file.gcount() == static_cast<std::streamsize>(count);
+    }
+
+    bool ReadTile(const Record& record, PackedTile& tile) {
+        file.clear();
+        file.seekg(record.offset);
+        tile.column = static_cast<int>(record.key >> 32);
+        tile.row = static_cast<int>(static_cast<unsigned>(record.key));
+        tile.scale = record.scale;
+        tile.width = record.width;
+        tile.height = record.height;
+        return ReadBytes(static_cast<size_t>(record.width) * record.height * 3, tile.rgb);
+    }
+};
+
+// Tiles to render between events: visible ones that missed a paint first, then guesses at where
+// a pan is heading from the last moments of scroll motion
+class PanPrefetcher {
+public:
+    enum { history = 150, lookahead = 300 }; // Milliseconds of motion behind the guess, and how far it looks ahead
+    bool enabled = true;
+
+    void RequestNow(int column, int row) {
+        urgent.push_back(wxPoint(column, row));
+    }
+
+    void RequestAhead(int column, int row) {
+        ahead.push_back(wxPoint(column, row));
+    }
+
+    // Replaces the guesses on every scroll, so a change of direction cancels the stale ones
+    void NoteScroll(const wxPoint& scroll, const wxSize& view, long now) {
+        motion.emplace_back(now, scroll);
+        while (motion.size() > 2 && now - motion.front().first > history) {
+            motion.pop_front();
+        }
+        ahead.clear();
+        if (!enabled || motion.size() < 2) {
+            return;
+        }
+        long elapsed = std::max(1L, now - motion.front().first);
+        double speedX = static_cast<double>(scroll.x - motion.front().second.x) / elapsed;
+        double speedY = static_cast<double>(scroll.y - motion.front().second.y) / elapsed;
+        if (speedX == 0 && speedY == 0) {
+            return;
+        }
+        // Everything between the view now and where it should be lookahead from now, nearest first
+        wxRect current(scroll, view);
+        wxRect predicted = current;
+        predicted.Offset(static_cast<int>(std::lround(speedX * lookahead)), static_cast<int>(std::lround(speedY * lookahead)));
+        wxRect region = predicted.Union(current).Inflate(CanvasTileCache::tileSize / 2);
+        std::vector<std::pair<long long, wxPoint>> tiles;
+        for (int row = FloorDiv(region.y, CanvasTileCache::tileSize); row <= FloorDiv(region.GetBottom(), CanvasTileCache::tileSize); ++row) {
+            for (int column = FloorDiv(region.x, CanvasTileCache::tileSize); column <= FloorDiv(region.GetRight(), CanvasTileCache::tileSize); ++column) {
+                wxRect tile = CanvasTileCache::GetTileRect(column, row);
+                long long dx = std::max(0, std::max(tile.x - current.GetRight(), current.x - tile.GetRight()));
+                long long dy = std::max(0, std::max(tile.y - current.GetBottom(), current.y - tile.GetBottom()));
+                tiles.emplace_back(dx * dx + dy * dy, wxPoint(column, row));
+            }
+        }
+        std::stable_sort(tiles.begin(), tiles.end(),
+                         [](const std::pair<long long, wxPoint>& a, const std::pair<long long, wxPoint>& b) { return a.first < b.first; });
+        for (const auto& tile : tiles) {
+            ahead.push_back(tile.second);
+        }
+    }
+
+    bool HasWork() const {
+        return !urgent.empty() || !ahead.empty();
+    }
+
+    bool Next(wxPoint& tile) {
+        std::deque<wxPoint>& queue = urgent.empty() ? ahead : urgent;
+        if (queue.empty()) {
+            return false;
+        }
+        tile = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    void Clear() {
+        urgent.clear();
+        ahead.clear();
+        motion.clear();
+    }
+
+private:
+    std::deque<std::pair<long, wxPoint>> motion; // Recent scroll positions with their times
+    std::deque<wxPoint> urgent;
+    std::deque<wxPoint> ahead;
+};
+
+// Freehand strokes are smoothed, simplified and rasterized on a dedicated thread. The UI thread only
+// enqueues raw mouse points; the worker hands back antialiased coverage for each tile the stroke has
+// touched, and at the end of the stroke the simplified points to commit
+class StrokePipeline {
+public:
+    enum { ringSize = 4096, tileSize = CanvasTileCache::tileSize };
+
+    struct Input {
+        enum Kind { start, move, finish, cancel };
+        Kind kind = move;
+        wxPoint point;
+        int width = 0; // Pen width, on start
+    };
+
+    struct Output {
+        enum Kind { tile, finished };
+        Kind kind = tile;
+        int column = 0;
+        int row = 0;
+        wxRect dirty; // Document area of the tile that changed
+        std::vector<unsigned char> coverage; // tileSize * tileSize, 255 fully covered
+        std::vector<wxPoint> points; // The committed stroke, when finished
+    };
+
+    ~StrokePipeline() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+    }
+
+    // Called on the worker thread when output is ready, once until Acknowledge()
+    void SetOutputHandler(std::function<void()> handler) {
+        onOutput = std::move(handler);
+    }
+
+    void Begin(const wxPoint& point, int width) {
+        Input input;
+        input.kind = Input::start;
+        input.point = point;
+        input.width = width;
+        Push(input);
+    }
+
+    void Add(const wxPoint& point) {
+        Input input;
+        input.point = point;
+        Push(input);
+    }
+
+    void End(const wxPoint& point) {
+        Input input;
+        input.kind = Input::finish;
+        input.point = point;
+        Push(input);
+    }
+
+    // Drop the stroke without drawing more of it; acknowledged by a finished output with no points
+    void Cancel() {
+        Input input;
+        input.kind = Input::cancel;
+        Push(input);
+    }
+
+    // UI thread: call before draining with Pop so output pushed meanwhile notifies again
+    void Acknowledge() {
+        notified = false;
+    }
+
+    bool Pop(Output& output) {
+        return outputs.TryPop(output);
+    }
+
+private:
+    enum { minSpacing = 2 }; // Pixels between kept points
+    struct Vec {
+        double x;
+        double y;
+    };
+
+    SpscRing<Input, ringSize> inputs;
+    SpscRing<Output, 256> outputs;
+    std::function<void()> onOutput;
+    std::atomic<bool> notified{ false };
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> waiting{ false };
+    std::atomic<bool> stopping{ false };
+
+    // Worker state for the stroke in progress
+    double width = 1;
+    std::vector<wxPoint> recent; // Last raw points, averaged for smoothing
+    std::vector<Vec> kept;
+    std::map<std::pair<int, int>, std::vector<unsigned char>> tiles;
+    std::map<std::pair<int, int>, wxRect> dirtyTiles;
+    bool finished = false;
+
+    void Push(const Input& input) {
+        if (!worker.joinable()) {
+            worker = std::thread([this] { Run(); });
+        }
+        Input queued = input;
+        while (!inputs.TryPush(std::move(queued))) {
+            std::this_thread::yield(); // Only if the worker falls a full ring behind
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in Run()
+        if (waiting) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake.notify_one();
+        }
+    }
+
+    void Run() {
+        for (;;) {
+            Input input;
+            bool received = false;
+            while (inputs.TryPop(input)) {
+                Process(input);
+                received = true;
+            }
+            if (received && !Emit()) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            waiting = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wake.wait(lock, [this] { return stopping || !inputs.IsEmpty(); });
+            waiting = false;
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    void Process(const Input& input) {
+        Vec at = { static_cast<double>(input.point.x), static_cast<double>(input.point.y) };
+        switch (input.kind) {
+        case Input::start:
+            width = input.width;
+            recent.assign(1, input.point);
+            kept.assign(1, at);
+            tiles.clear();
+            Rasterize(at, at);
+            break;
+        case Input::move: {
+            // Average of the last three raw points takes out mouse jitter
+            recent.push_back(input.point);
+            if (recent.size() > 3) {
+                recent.erase(recent.begin());
+            }
+            Vec smoothed = { 0, 0 };
+            for (const wxPoint& point : recent) {
+                smoothed.x += point.x;
+                smoothed.y += point.y;
+            }
+            smoothed.x /= recent.size();
+            smoothed.y /= recent.size();
+            Keep(smoothed, false);
+            break;
+        }
+        case Input::finish:
+            Keep(at, true); // The stroke ends exactly at the cursor
+            finished = true;
+            break;
+        case Input::cancel:
+            recent.clear();
+            kept.clear();
+            tiles.clear();
+            dirtyTiles.clear();
+            finished = true;
+            break;
+        }
+    }
+
+    // Drop points too close to the last kept one, and merge a point that continues a straight run
+    void Keep(const Vec& point, bool force) {
+        Vec last = kept.back();
+        if (!force && std::hypot(point.x - last.x, point.y - last.y) < minSpacing) {
+            return;
+        }
+        if (kept.size() >= 2 && DistanceToSegment(last, kept[kept.size() - 2], point) < 0.5) {
+            kept.back() = point;
+        }
+        else {
+            kept.push_back(point);
+        }
+        Rasterize(last, point);
+    }
+
+    static double DistanceToSegment(const Vec& point, const Vec& a, const Vec& b) {
+        double dx = b.x - a.x, dy = b.y - a.y;
+        double length = dx * dx + dy * dy;
+        double t = length > 0 ? std::max(0.0, std::min(1.0, ((point.x - a.x) * dx + (point.y - a.y) * dy) / length)) : 0;
+        return std::hypot(point.x - (a.x + t * dx), point.y - (a.y + t * dy));
+    }
+
+    // Antialiased coverage of a round-capped segment, into every tile it touches. Tiles of the
+    // bounding box that the capsule misses get no coverage, so a long diagonal stays cheap
+    void Rasterize(const Vec& a, const Vec& b) {
+        double reach = width / 2 + 1;
+        double tileReach = reach + tileSize / std::sqrt(2.0); // From a tile's centre to its corners, and the pen
+        wxRect area(wxPoint(static_cast<int>(std::floor(std::min(a.x, b.x) - reach)), static_cast<int>(std::floor(std::min(a.y, b.y) - reach))),
+                    wxPoint(static_cast<int>(std::ceil(std::max(a.x, b.x) + reach)), static_cast<int>(std::ceil(std::max(a.y, b.y) + reach))));
+        for (int row = FloorDiv(area.y, tileSize); row <= FloorDiv(area.GetBottom(), tileSize); ++row) {
+            for (int column = FloorDiv(area.x, tileSize); column <= FloorDiv(area.GetRight(), tileSize); ++column) {
+                wxRect tile = CanvasTileCache::GetTileRect(column, row);
+                if (DistanceToSegment(Vec{ tile.x + tileSize / 2.0, tile.y + tileSize / 2.0 }, a, b) > tileReach) {
+                    continue;
+                }
+                wxRect part = tile;
+                part.Intersect(area);
+                std::vector<unsigned char>& coverage = tiles[std::make_pair(column, row)];
+                if (coverage.empty()) {
+                    coverage.assign(tileSize * tileSize, 0);
+                }
+                for (int y = part.y; y <= part.GetBottom(); ++y) {
+                    unsigned char* pixel = &coverage[(y - tile.y) * tileSize + part.x - tile.x];
+                    for (int x = part.x; x <= part.GetRight(); ++x, ++pixel) {
+                        double inside = width / 2 + 0.5 - DistanceToSegment(Vec{ x + 0.5, y + 0.5 }, a, b);
+                        if (inside > 0) {
+                            *pixel = std::max(*pixel, static_cast<unsigned char>(std::min(1.0, inside) * 255));
+                        }
+                    }
+                }
+                wxRect& dirty = dirtyTiles[std::make_pair(column, row)];
+                dirty = dirty.IsEmpty() ? part : dirty.Union(part);
+            }
+        }
+    }
+
+    // Hand changed tiles, and the points of a finished stroke, to the UI thread; false when stopping
+    bool Emit() {
+        for (auto& dirty : dirtyTiles) {
+            Output output;
+            output.column = dirty.first.first;
+            output.row = dirty.first.second;
+            output.dirty = dirty.second;
+            output.coverage = tiles[dirty.first];
+            if (!PushOutput(output)) {
+                return false;
+            }
+        }
+        dirtyTiles.clear();
+        if (finished) {
+            finished = false;
+            Output output;
+            output.kind = Output::finished;
+            for (const Vec& point : kept) {
+                wxPoint rounded(static_cast<int>(std::lround(point.x)), static_cast<int>(std::lround(point.y)));
+                if (output.points.empty() || output.points.back() != rounded) {
+                    output.points.push_back(rounded);
+                }
+            }
+            tiles.clear();
+            if (!PushOutput(output)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool PushOutput(Output& output) {
+        while (!outputs.TryPush(std::move(output))) {
+            if (stopping) {
+                return false;
+            }
+            std::this_thread::yield(); // The UI thread drains as it presents
+        }
+        if (!notified.exchange(true) && onOutput) {
+            onOutput();
+        }
+        return true;
+    }
+};
+
+// One undoable edit: the shapes it added and the image pixels it changed
+struct HistoryEntry {
+    std::vector<Shape*> shapes; // Owned by the entry while it sits on the redo stack
+    std::vector<std::pair<ImageShape*, TiledRaster>> rasters; // Pixels on the other side of the edit
+};
+
+// Debug views drawn into the canvas tiles in place of the plain content
+enum HeatmapMode {
+    HEATMAP_NONE,
+    HEATMAP_OVERDRAW, // Times each pixel was written
+    HEATMAP_COST // Draw time per pixel, each shape's time spread over the pixels it wrote
+};
+
+// Milliseconds from launch to the first frames, for judging session restore
+struct StartupTiming {
+    wxStopWatch clock;       // Started in MyApp::OnInit
+    long firstPaint = -1;    // First frame drawn
+    long completePaint = -1; // First frame without blank tiles
+    long restored = -1;      // Every document of the last session loaded
+
+    wxString Describe() const {
+        auto format = [](long milliseconds) {
+            return milliseconds < 0 ? wxString("not yet") : wxString::Format("%ld ms", milliseconds);
+        };
+        return "First paint: " + format(firstPaint) + "\nFirst complete paint: " + format(completePaint) +
+            "\nSession restored: " + format(restored);
+    }
+};
+
+StartupTiming& GetStartupTiming() {
+    static StartupTiming timing;
+    return timing;
+}
+
+// Canvas class
+class PaintCanvas : public wxPanel {
+private:
+    std::vector<Shape*> shapes;
+    std::vector<HistoryEntry> undoStack;
+    std::vector<HistoryEntry> redoStack;
+    std::vector<Shape*> selection; // Selected shapes, in document order
+    wxRect selectionBand;          // Rubber band while dragging with the select tool
+    bool selecting = false;
+    FreehandLine* currentLine = nullptr;
+    Shape* previewShape = nullptr; // Shape being sized by dragging, not yet committed
+    wxPoint dragStart;             // Where the current shape drag began
+    std::vector<wxPoint> polygonPoints; // Vertices placed so far with the polygon tool
+    ShapeGrid grid;                // Committed shapes by tile, for drawing and hit testing one area
+    CanvasTileCache tiles;         // Committed shapes rendered once; only changes on commit
+    TilePack tilePack;             // Tiles stored for the document as opened; closed at the first edit
+    struct LoadTiming {
+        wxStopWatch clock;       // Started by OpenDocument
+        long firstSlice = -1;
+        long firstPaint = -1;
+        long loaded = -1;
+        long completePaint = -1;
+        size_t shapes = 0;
+    } loadTiming;
+    int loadGeneration = 0;        // Slices scheduled for an earlier open stop when this moves on
+    bool packCurrent = false;      // Whether the pack beside the file was written from what it holds now
+    bool packUnchecked = false;    // Opened pack whose document hash a worker is still checking
+    int freshTiles = 0;            // Tiles drawn rather than read from the pack since it was last written
+    wxPoint scroll;                // Document position at the window's top left
+    bool panning = false;
+    wxPoint panStart;              // Window position where a middle-button pan began
+    wxPoint panScrollStart;
+    PanPrefetcher prefetcher;
+    bool tileRenderScheduled = false;
+    bool batchedRendering = false; // Tiles drawn through PathBatcher instead of per-shape DC calls
+    HeatmapMode heatmapMode = HEATMAP_NONE;
+    struct HeatStats {
+        unsigned long long writes = 0; // Pixels written by drawn shapes
+        unsigned long long savedWrites = 0; // Pixels hidden shapes would have written
+        long long microseconds = 0;
+        long long slowestShape = 0;
+    };
+    std::map<std::pair<int, int>, HeatStats> heatStats; // Of the last heat tile drawn at each position
+    wxStopWatch panClock;          // Time base for pan motion and traces
+    std::vector<std::pair<long, wxPoint>> panTrace; // Recorded scroll positions, replayed to measure prefetching
+    bool recordingPan = false;
+    long traceStart = 0;
+    wxTimer replayTimer;
+    size_t replayStep = 0;
+    int replayPass = -1;           // 0 without prefetching, 1 with; -1 when not replaying
+    int replayBlankFrames[2] = { 0, 0 };
+    int paintedFrames = 0;
+    int blankFrames = 0;           // Frames that showed at least one tile not rendered yet
+    std::shared_ptr<char> alive = std::make_shared<char>(); // Expires with the canvas, guards deferred tile renders
+    // Handed to freehand lines for when their paged-out points are back; expires with the canvas
+    std::shared_ptr<const std::function<void(const wxRect&)>> strokeRepaint =
+        std::make_shared<const std::function<void(const wxRect&)>>([this](const wxRect& rect) { RepaintCacheRegion(rect); });
+    StrokePipeline strokes; // Geometry and raster work for currentLine, off the UI thread
+    struct LiveTile {
+        std::vector<unsigned char> coverage;
+        wxBitmap bitmap; // Coverage in the stroke's color
+    };
+    std::map<std::pair<int, int>, LiveTile> liveTiles; // The stroke in progress, drawn over the cached tiles
+    wxColor liveColor;
+    wxSize viewSize;               // Client size at the last size event
+    wxStopWatch sinceResize;       // Paints right after a size event count as live resizing
+    wxColor currentColor;
+    bool rainbowMode = false;
+    bool eraserMode = false;
+    ShapeTool shapeTool = TOOL_NONE; // Shape mode, TOOL_NONE draws freehand
+    int shapeSize = 50;       // Default size for shapes placed with a click
+    wxFont textFont = wxFont(14, wxFONTFAMILY_SWISS, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_NORMAL);
+    Journal journal;          // Edits not yet saved to the document file
+    std::shared_ptr<WorkGroup> workGroup = std::make_shared<WorkGroup>(); // Priority of this document's background work
+
+public:
+    PaintCanvas(wxWindow* parent) : wxPanel(parent) {
+        currentColor = *wxBLACK; // Default color
+        SetBackgroundStyle(wxBG_STYLE_PAINT); // OnPaint covers the whole update region from the cache
+
+        Bind(wxEVT_PAINT, &PaintCanvas::OnPaint, this);
+        Bind(wxEVT_SIZE, &PaintCanvas::OnSize, this);
+        Bind(wxEVT_DPI_CHANGED, [this](wxDPIChangedEvent& event) {
+            tiles.ReserveFor(GetClientSize(), GetScalePercent());
+            Refresh(false); // Tiles at the new scale are drawn as they are painted
+            event.Skip();
+        });
+        Bind(wxEVT_LEFT_DOWN, &PaintCanvas::OnLeftDown, this);
+        Bind(wxEVT_LEFT_UP, &PaintCanvas::OnLeftUp, this);
+        Bind(wxEVT_LEFT_DCLICK, &PaintCanvas::OnLeftDClick, this);
+        Bind(wxEVT_MOTION, &PaintCanvas::OnMouseMove, this);
+        Bind(wxEVT_MOUSE_CAPTURE_LOST, &PaintCanvas::OnCaptureLost, this);
+        Bind(wxEVT_MIDDLE_DOWN, &PaintCanvas::OnMiddleDown, this);
+        Bind(wxEVT_MIDDLE_UP, &PaintCanvas::OnMiddleUp, this);
+        Bind(wxEVT_MOUSEWHEEL, &PaintCanvas::OnMouseWheel, this);
+        replayTimer.Bind(wxEVT_TIMER, &PaintCanvas::OnReplayTimer, this);
+
+        std::weak_ptr<char> guard = alive;
+        strokes.SetOutputHandler([this, guard] {
+            wxTheApp->CallAfter([this, guard] {
+                if (!guard.expired()) {
+                    std::vector<wxPoint> unused;
+                    PresentStroke(unused);
+                }
+            });
+        });
+    }
+
+    ~PaintCanvas() {
+        AbandonCompaction();
+        StoreTiles(false);
+        for (Shape* shape : shapes) {
+            delete shape; // Clean up allocated memory
+        }
+        ClearRedo();
+        delete currentLine;
+        delete previewShape;
+    }
+
+    // Content scale in percent; tiles are drawn in device pixels so HiDPI screens get sharp shapes
+    int GetScalePercent() const {
+        return static_cast<int>(std::lround(GetContentScaleFactor() * 100));
+    }
+
+    // Draw the committed shapes of one tile at scale into a fresh cached bitmap
+    wxBitmap& RenderTile(int column, int row, int scale) {
+        wxStopWatch watch;
+        wxBitmap bitmap;
+        if (heatmapMode != HEATMAP_NONE || !tilePack.Load(column, row, scale, bitmap)) {
+            ++freshTiles;
+            bitmap = heatmapMode == HEATMAP_NONE ? DrawTile(column, row, scale) : DrawHeatTile(column, row, scale);
+        }
+        if (tiles.WasShed(column, row, scale)) {
+            tiles.NoteRebuild(watch.TimeInMicro());
+        }
+        return tiles.Insert(column, row, scale, bitmap);
+    }
+
+    wxBitmap DrawTile(int column, int row, int scale) {
+        wxBitmap bitmap;
+        bitmap.CreateWithDIPSize(wxSize(CanvasTileCache::tileSize, CanvasTileCache::tileSize), scale / 100.0);
+        wxMemoryDC memDC(bitmap);
+        memDC.SetBackground(wxBrush(GetBackgroundColour()));
+        memDC.Clear();
+        wxRect tile = CanvasTileCache::GetTileRect(column, row);
+        memDC.SetDeviceOrigin(-tile.x, -tile.y);
+        std::vector<Shape*> drawn;
+        if (const std::vector<ShapeGrid::Entry>* cell = grid.GetCell(column, row)) {
+            for (const ShapeGrid::Entry& entry : *cell) {
+                if (!entry.hidden) {
+                    drawn.push_back(entry.shape);
+                }
+            }
+        }
+        DrawTileShapes(memDC, tile, tile, drawn);
+        memDC.SelectObject(wxNullBitmap);
+        return bitmap;
+    }
+
+    // Draw shapes into the tile selected into memDC, whose origin and clip are already set up,
+    // either one DC call per shape or batched into graphics paths. Every tile update goes through
+    // here so a tile never mixes the two backends' antialiasing
+    void DrawTileShapes(wxMemoryDC& memDC, const wxRect& tile, const wxRect& clip, const std::vector<Shape*>& drawn) {
+        if (!batchedRendering) {
+            for (Shape* shape : drawn) {
+                shape->Draw(memDC);
+            }
+            return;
+        }
+        memDC.SetDeviceOrigin(0, 0); // Some ports copy the DC transform into the context; set it once, below
+        wxGCDC gcdc(GetBatchRenderer()->CreateContext(memDC));
+        gcdc.SetDeviceOrigin(-tile.x, -tile.y);
+        gcdc.SetClippingRegion(clip);
+        PathBatcher batcher(gcdc);
+        for (Shape* shape : drawn) {
+            batcher.Add(shape);
+        }
+        batcher.Flush();
+    }
+
+    // Heatmap tiles replace the cached ones until the mode is switched off
+    void SetHeatmapMode(HeatmapMode mode) {
+        if (mode != heatmapMode) {
+            heatmapMode = mode;
+            tiles.Clear();
+            heatStats.clear();
+            Refresh(false);
+        }
+    }
+
+    // Debug tile showing the real content tinted by how often each pixel was written (overdraw) or by
+    // the draw time spent on it (cost). Each shape goes through DrawTileShapes on its own, as in the
+    // normal render, into a scratch tile filled with a key color, so the pixels it wrote can be read
+    // back. Shapes culled as hidden are measured too, for what occlusion saves
+    wxBitmap DrawHeatTile(int column, int row, int scale) {
+        const int size = CanvasTileCache::tileSize;
+        const wxColor key(255, 0, 254); // Unlikely to be drawn by a shape
+        wxBitmap bitmap = DrawTile(column, row, scale);
+        wxRect tile = CanvasTileCache::GetTileRect(column, row);
+        std::vector<unsigned short> writes(size * size, 0);
+        std::vector<double> nanoseconds(size * size, 0);
+        HeatStats& stats = heatStats[std::make_pair(column, row)];
+        stats = HeatStats();
+        wxBitmap scratch(size, size);
+        wxMemoryDC scratchDC;
+        if (const std::vector<ShapeGrid::Entry>* cell = grid.GetCell(column, row)) {
+            for (const ShapeGrid::Entry& entry : *cell) {
+                wxRect area = entry.shape->GetBounds().Intersect(tile);
+                if (area.IsEmpty()) {
+                    continue;
+                }
+                scratchDC.SelectObject(scratch);
+                scratchDC.SetDeviceOrigin(-tile.x, -tile.y);
+                scratchDC.SetClippingRegion(area);
+                scratchDC.SetPen(*wxTRANSPARENT_PEN);
+                scratchDC.SetBrush(wxBrush(key));
+                scratchDC.DrawRectangle(area);
+                wxStopWatch watch;
+                DrawTileShapes(scratchDC, tile, area, std::vector<Shape*>(1, entry.shape));
+                long long microseconds = watch.TimeInMicro();
+                scratchDC.DestroyClippingRegion();
+                scratchDC.SelectObject(wxNullBitmap); // Some ports cannot read a bitmap still selected
+
+                wxRect local = area;
+                local.Offset(-tile.x, -tile.y);
+                wxImage image = scratch.GetSubBitmap(local).ConvertToImage();
+                const unsigned char* pixel = image.GetData();
+                std::vector<size_t> written;
+                for (int y = 0; y < local.height; ++y) {
+                    for (int x = 0; x < local.width; ++x, pixel += 3) {
+                        if (pixel[0] != key.Red() || pixel[1] != key.Green() || pixel[2] != key.Blue()) {
+                            written.push_back(static_cast<size_t>(local.y + y) * size + local.x + x);
+                        }
+                    }
+                }
+                if (entry.hidden) {
+                    stats.savedWrites += written.size();
+                    continue;
+                }
+                stats.writes += written.size();
+                stats.microseconds += microseconds;
+                stats.slowestShape = std::max(stats.slowestShape, microseconds);
+                for (size_t index : written) {
+                    ++writes[index];
+                    nanoseconds[index] += microseconds * 1000.0 / written.size();
+                }
+            }
+        }
+
+        // Blue through red: written once to five or more times, or under 5 to over 320 ns per pixel
+        static const unsigned char heat[5][3] = { { 0, 0, 255 }, { 0, 200, 0 }, { 255, 220, 0 }, { 255, 120, 0 }, { 255, 0, 0 } };
+        wxImage overlay(size, size, false);
+        overlay.InitAlpha();
+        unsigned char* pixel = overlay.GetData();
+        unsigned char* alpha = overlay.GetAlpha();
+        for (size_t i = 0; i < writes.size(); ++i, pixel += 3) {
+            int level = 0;
+            if (heatmapMode == HEATMAP_OVERDRAW) {
+                level = std::max(1, std::min<int>(writes[i], 5)) - 1;
+            }
+            else {
+                for (double limit = 5; level < 4 && nanoseconds[i] >= limit; limit *= 4) {
+                    ++level;
+                }
+            }
+            std::copy(heat[level], heat[level] + 3, pixel);
+            alpha[i] = writes[i] ? 150 : 0;
+        }
+        wxMemoryDC memDC(bitmap);
+        memDC.DrawBitmap(wxBitmap(overlay), 0, 0, true);
+        memDC.SelectObject(wxNullBitmap);
+        return bitmap;
+    }
+
+    // Totals of the heat tiles in view
+    wxString DescribeHeatmap() const {
+        wxRect view(scroll, GetClientSize());
+        HeatStats total;
+        for (int row = FloorDiv(view.y, CanvasTileCache::tileSize); row <= FloorDiv(view.GetBottom(), CanvasTileCache::tileSize); ++row) {
+            for (int column = FloorDiv(view.x, CanvasTileCache::tileSize); column <= FloorDiv(view.GetRight(), CanvasTileCache::tileSize); ++column) {
+                auto found = heatStats.find(std::make_pair(column, row));
+                if (found != heatStats.end()) {
+                    total.writes += found->second.writes;
+                    total.savedWrites += found->second.savedWrites;
+                    total.microseconds += found->second.microseconds;
+                    total.slowestShape = std::max(total.slowestShape, found->second.slowestShape);
+                }
+            }
+        }
+        double area = std::max(1.0, static_cast<double>(view.width) * view.height);
+        unsigned long long all = total.writes + total.savedWrites;
+        return wxString::Format("%.2f writes/pixel, occlusion saves %.1f%%, %.1f ms drawing, slowest shape %lld us",
+                                total.writes / area, all ? 100.0 * total.savedWrites / all : 0.0,
+                                total.microseconds / 1000.0, total.slowestShape);
+    }
+
+    // Cached tiles are redrawn with the new backend as they are painted; the pack was drawn by the old one
+    void SetBatchedRendering(bool enabled) {
+        if (enabled != batchedRendering) {
+            batchedRendering = enabled;
+            tiles.Clear();
+            tilePack.Close();
+            packCurrent = false;
+            Refresh(false);
+        }
+    }
+
+    // Draw a newly committed shape into the cached tiles it touches, at every cached scale
+    void DrawIntoTiles(Shape* shape) {
+        wxRect bounds = shape->GetBounds();
+        if (RedrawHeatTiles(bounds)) {
+            return;
+        }
+        wxMemoryDC memDC;
+        for (int scale : tiles.GetScales()) {
+            for (int row = FloorDiv(bounds.y, CanvasTileCache::tileSize); row <= FloorDiv(bounds.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                for (int column = FloorDiv(bounds.x, CanvasTileCache::tileSize); column <= FloorDiv(bounds.GetRight(), CanvasTileCache::tileSize); ++column) {
+                    if (wxBitmap* bitmap = tiles.Peek(column, row, scale)) {
+                        wxRect tile = CanvasTileCache::GetTileRect(column, row);
+                        memDC.SelectObject(*bitmap);
+                        memDC.SetDeviceOrigin(-tile.x, -tile.y);
+                        DrawTileShapes(memDC, tile, tile, std::vector<Shape*>(1, shape));
+                    }
+                }
+            }
+        }
+    }
+
+    // Heat tiles are measured per whole tile, so edits redraw the cached tiles they touch from scratch
+    bool RedrawHeatTiles(const wxRect& rect) {
+        if (heatmapMode == HEATMAP_NONE) {
+            return false;
+        }
+        for (int scale : tiles.GetScales()) {
+            for (int row = FloorDiv(rect.y, CanvasTileCache::tileSize); row <= FloorDiv(rect.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                for (int column = FloorDiv(rect.x, CanvasTileCache::tileSize); column <= FloorDiv(rect.GetRight(), CanvasTileCache::tileSize); ++column) {
+                    if (tiles.Peek(column, row, scale)) {
+                        RenderTile(column, row, scale);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Document rects to window coordinates
+    void RefreshDocument(const wxRect& rect) {
+        wxRect area = rect;
+        area.Offset(-scroll.x, -scroll.y);
+        RefreshRect(area, false);
+    }
+
+    wxPoint ToDocument(const wxPoint& position) const {
+        return position + scroll;
+    }
+
+    // Move the view; what stays on screen is shifted and only the exposed strips are repainted
+    void ScrollTo(const wxPoint& position) {
+        wxPoint delta = position - scroll;
+        if (delta == wxPoint()) {
+            return;
+        }
+        scroll = position;
+        ScrollWindow(-delta.x, -delta.y);
+        prefetcher.NoteScroll(scroll, GetClientSize(), panClock.Time());
+        ScheduleTileRendering();
+        if (recordingPan) {
+            panTrace.emplace_back(panClock.Time() - traceStart, scroll);
+        }
+    }
+
+    // Render queued tiles a few milliseconds at a time between events, so panning stays responsive.
+    // wx drawing is UI thread only, so this interleaves with input instead of running on workers
+    void ScheduleTileRendering() {
+        if (tileRenderScheduled || !prefetcher.HasWork()) {
+            return;
+        }
+        tileRenderScheduled = true;
+        std::weak_ptr<char> guard = alive;
+        wxTheApp->CallAfter([this, guard] {
+            if (guard.expired()) {
+                return;
+            }
+            tileRenderScheduled = false;
+            wxStopWatch slice;
+            wxPoint tile;
+            while (slice.Time() < tileSliceTime && prefetcher.Next(tile)) {
+                if (!tiles.Peek(tile.x, tile.y, GetScalePercent())) {
+                    RenderTile(tile.x, tile.y, GetScalePercent());
+                    RefreshDocument(CanvasTileCache::GetTileRect(tile.x, tile.y));
+                }
+            }
+            ScheduleTileRendering();
+        });
+    }
+
+    void StartPanRecording() {
+        panTrace.clear();
+        traceStart = panClock.Time();
+        recordingPan = true;
+    }
+
+    void StopPanRecording() {
+        recordingPan = false;
+    }
+
+    // Play the recorded pan back twice, without and with prefetching, counting frames with blank tiles
+    void ReplayPanTrace() {
+        if (panTrace.size() < 2 || replayPass >= 0) {
+            wxMessageBox("Record a pan with the middle mouse button or wheel first.", "Pan Trace", wxOK | wxICON_INFORMATION, this);
+            return;
+        }
+        recordingPan = false;
+        replayPass = 0;
+        BeginReplayPass();
+    }
+
+    // Add a finished shape to the document and draw just that shape into the cache
+    void CommitShape(Shape* shape, HistoryEntry entry = HistoryEntry()) {
+        CommitShapes(std::vector<Shape*>(1, shape), std::move(entry));
+    }
+
+    // Add several shapes as one undo step, drawing only them into the cache. Large commits are indexed
+    // in bulk with occlusion left to idle time, and drop the tiles they cover in one go instead
+    void CommitShapes(const std::vector<Shape*>& added, HistoryEntry entry = HistoryEntry()) {
+        FinishLoading(); // New shapes go after the whole file
+        tilePack.Close(); // Its tiles show the document as opened
+        packCurrent = false;
+        for (Shape* shape : added) {
+            if (FreehandLine* line = dynamic_cast<FreehandLine*>(shape)) {
+                line->Intern();
+                line->SetOwner(strokeRepaint);
+            }
+        }
+        wxRect dirty;
+        shapes.reserve(shapes.size() + added.size());
+        journal.RecordAdd(added);
+        bool bulk = added.size() >= bulkInsertSize;
+        if (bulk) {
+            grid.AddAll(added, true);
+        }
+        for (Shape* shape : added) {
+            if (ImageShape* image = dynamic_cast<ImageShape*>(shape)) {
+                image->SetOwner([this](const wxRect& rect) { RepaintCacheRegion(rect); },
+                                [this](Shape* resized, const wxRect& before) { grid.Rebucket(resized, before); }, workGroup);
+            }
+            shapes.push_back(shape);
+            if (!bulk) {
+                grid.Add(shape);
+                DrawIntoTiles(shape);
+            }
+            dirty.Union(shape->GetBounds());
+        }
+        if (bulk) {
+            tiles.Invalidate(dirty);
+        }
+        RefreshDocument(dirty);
+        entry.shapes.insert(entry.shapes.end(), added.begin(), added.end());
+        undoStack.push_back(std::move(entry));
+        ClearRedo();
+        GetIdleScheduler().Poke();
+    }
+
+    // Commit the shapes of a batch built in code as one undo step, emptying the batch
+    void InsertBatch(ShapeBatch& batch) {
+        std::vector<Shape*> added = batch.Release();
+        if (!added.empty()) {
+            CommitShapes(added);
+        }
+    }
+
+    // Apply an eraser stroke to the pixels of images underneath it
+    HistoryEntry EraseImagesUnder(const FreehandLine& line) {
+        HistoryEntry entry;
+        for (Shape* shape : shapes) {
+            ImageShape* image = dynamic_cast<ImageShape*>(shape);
+            TiledRaster before;
+            if (image && image->GetBounds().Intersects(line.GetBounds()) &&
+                image->EraseStroke(line.GetPoints(), line.GetOffset(), 2, before)) {
+                entry.rasters.emplace_back(image, before);
+            }
+        }
+        return entry;
+    }
+
+    void Undo() {
+        if (undoStack.empty()) {
+            return;
+        }
+        SetSelection(std::vector<Shape*>());
+        HistoryEntry entry = std::move(undoStack.back());
+        undoStack.pop_back();
+        // The entry's shapes are always the newest ones, since later edits were undone first
+        shapes.resize(shapes.size() - entry.shapes.size());
+        journal.RecordRemove(static_cast<int>(entry.shapes.size()));
+        if (entry.shapes.size() >= bulkInsertSize) {
+            grid.RemoveNewestAll(entry.shapes);
+            GetIdleScheduler().Poke();
+        }
+        else {
+            for (auto it = entry.shapes.rbegin(); it != entry.shapes.rend(); ++it) {
+                grid.RemoveNewest(*it);
+            }
+        }
+        RepaintShapes(entry.shapes);
+        for (auto& raster : entry.rasters) {
+            raster.first->SwapRaster(raster.second);
+        }
+        redoStack.push_back(std::move(entry));
+    }
+
+    void Redo() {
+        if (redoStack.empty()) {
+            return;
+        }
+        SetSelection(std::vector<Shape*>());
+        HistoryEntry entry = std::move(redoStack.back());
+        redoStack.pop_back();
+        for (auto& raster : entry.rasters) {
+            raster.first->SwapRaster(raster.second);
+        }
+        shapes.insert(shapes.end(), entry.shapes.begin(), entry.shapes.end());
+        if (entry.shapes.size() >= bulkInsertSize) {
+            grid.AddAll(entry.shapes, true);
+            GetIdleScheduler().Poke();
+        }
+        else {
+            for (Shape* shape : entry.shapes) {
+                grid.Add(shape);
+            }
+        }
+        RepaintShapes(entry.shapes);
+        journal.RecordAdd(entry.shapes);
+        undoStack.push_back(std::move(entry));
+    }
+
+    // Undo/redo step counts and how much pixel data history keeps beyond the current images
+    wxString DescribeHistory() const {
+        size_t rasterBytes = 0;
+        int snapshots = 0;
+        for (const std::vector<HistoryEntry>* stack : { &undoStack, &redoStack }) {
+            for (const HistoryEntry& entry : *stack) {
+                for (const auto& raster : entry.rasters) {
+                    rasterBytes += raster.first->GetHistoryBytes(raster.second);
+                    ++snapshots;
+                }
+            }
+        }
+        return wxString::Format("Undo steps: %d\nRedo steps: %d\nImage snapshots: %d\nUnshared snapshot pixels: %lu KB",
+            static_cast<int>(undoStack.size()), static_cast<int>(redoStack.size()), snapshots,
+            static_cast<unsigned long>(rasterBytes / 1024));
+    }
+
+    // How much freehand point data this document's strokes share through the point store
+    wxString DescribeStrokeSharing() const {
+        std::unordered_map<const wxPoint*, size_t> buffers;
+        size_t strokes = 0, referenced = 0, stored = 0;
+        for (Shape* shape : shapes) {
+            FreehandLine* line = dynamic_cast<FreehandLine*>(shape);
+            if (line && line->IsResident()) { // Paged-out strokes are left out
+                ++strokes;
+                referenced += line->GetPoints().size();
+                if (++buffers[line->GetPoints().data()] == 1) {
+                    stored += line->GetPoints().size();
+                }
+            }
+        }
+        return wxString::Format("Resident strokes: %zu\nPoint buffers: %zu\nPoints drawn: %zu\nPoints stored: %zu\n"
+            "Dedup ratio: %.2f\nStrokes given a shared buffer this session: %zu",
+            strokes, buffers.size(), referenced, stored, stored ? static_cast<double>(referenced) / stored : 1.0,
+            GetPointStore().GetSharedCount());
+    }
+
+    wxRect GetSelectionBounds() const {
+        wxRect bounds;
+        for (Shape* shape : selection) {
+            bounds.Union(shape->GetBounds());
+        }
+        return bounds;
+    }
+
+    void SetSelection(const std::vector<Shape*>& selected) {
+        RefreshDocument(GetSelectionBounds().Inflate(2));
+        selection = selected;
+        RefreshDocument(GetSelectionBounds().Inflate(2));
+    }
+
+    // Shapes hit by a click, or touched by a dragged band
+    std::vector<Shape*> FindShapes(const wxRect& band, bool click) const {
+        std::vector<Shape*> found = grid.Query(click ? wxRect(band.GetPosition(), wxSize(1, 1)) : band);
+        if (click && found.size() > 1) {
+            found.erase(found.begin(), found.end() - 1); // Topmost shape only
+        }
+        return found;
+    }
+
+    // Put the selection on the clipboard as shape data, a bitmap and SVG
+    void CopySelection() {
+        if (selection.empty()) {
+            return;
+        }
+        ShapeClipboard& clipboard = GetShapeClipboard();
+        clipboard.shapes.clear();
+        for (Shape* shape : selection) {
+            clipboard.shapes.emplace_back(shape->Clone()); // Shares point buffers with the originals
+        }
+        unsigned long long stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        clipboard.token[0] = static_cast<unsigned int>(stamp);
+        clipboard.token[1] = static_cast<unsigned int>(stamp >> 32);
+        clipboard.pasteCount = 0;
+
+        ShapeWriter out;
+        out.WriteInt(shapesMagic);
+        out.WriteInt(shapesVersion);
+        out.WriteInt(clipboard.token[0]);
+        out.WriteInt(clipboard.token[1]);
+        out.WriteInt(static_cast<int>(selection.size()));
+        for (Shape* shape : selection) {
+            shape->Write(out);
+        }
+
+        wxRect bounds = GetSelectionBounds();
+        for (Shape* shape : selection) {
+            if (FreehandLine* line = dynamic_cast<FreehandLine*>(shape)) {
+                line->LoadPoints(); // The clipboard images get the strokes, not their placeholders
+            }
+        }
+        wxDataObjectComposite* data = new wxDataObjectComposite;
+        wxCustomDataObject* shapeData = new wxCustomDataObject(GetShapesFormat());
+        shapeData->SetData(out.bytes.size(), out.bytes.data());
+        data->Add(shapeData, true);
+        data->Add(new wxBitmapDataObject(RenderSelection(bounds)));
+        std::string svg = RenderSelectionSvg(bounds);
+        if (!svg.empty()) {
+            wxCustomDataObject* svgData = new wxCustomDataObject(wxDataFormat("image/svg+xml"));
+            svgData->SetData(svg.size(), svg.data());
+            data->Add(svgData);
+        }
+        wxClipboardLocker locker;
+        if (!locker) {
+            delete data;
+            return;
+        }
+        wxTheClipboard->SetData(data);
+    }
+
+    void Paste() {
+        std::vector<unsigned char> bytes;
+        {
+            wxClipboardLocker locker;
+            wxCustomDataObject shapeData(GetShapesFormat());
+            if (!locker || !wxTheClipboard->IsSupported(GetShapesFormat()) || !wxTheClipboard->GetData(shapeData)) {
+                return;
+            }
+            const unsigned char* begin = static_cast<const unsigned char*>(shapeData.GetData());
+            bytes.assign(begin, begin + shapeData.GetSize());
+        }
+        ShapeReader in(bytes.data(), bytes.size());
+        if (static_cast<unsigned int>(in.ReadInt()) != shapesMagic || in.ReadInt() > shapesVersion) {
+            return;
+        }
+        unsigned int token[2];
+        token[0] = static_cast<unsigned int>(in.ReadInt());
+        token[1] = static_cast<unsigned int>(in.ReadInt());
+        int count = in.ReadInt();
+
+        ShapeClipboard& clipboard = GetShapeClipboard();
+        std::vector<Shape*> pasted;
+        if (token[0] == clipboard.token[0] && token[1] == clipboard.token[1]) {
+            // Our own copy: clone the kept shapes, sharing their point data
+            pasted.reserve(clipboard.shapes.size());
+            for (const std::unique_ptr<Shape>& shape : clipboard.shapes) {
+                pasted.push_back(shape->Clone());
+            }
+        }
+        else {
+            for (int i = 0; i < count && in.IsOk(); ++i) {
+                if (Shape* shape = ReadShape(in)) {
+                    pasted.push_back(shape);
+                }
+            }
+        }
+        if (pasted.empty()) {
+            return;
+        }
+        int distance = 20 * ++clipboard.pasteCount;
+        for (Shape* shape : pasted) {
+            shape->Offset(wxPoint(distance, distance));
+        }
+        CommitShapes(pasted);
+        SetSelection(pasted);
+    }
+
+    wxBitmap RenderSelection(const wxRect& bounds) {
+        wxBitmap bitmap(std::max(bounds.width, 1), std::max(bounds.height, 1));
+        wxMemoryDC memDC(bitmap);
+        memDC.SetBackground(*wxWHITE_BRUSH);
+        memDC.Clear();
+        memDC.SetDeviceOrigin(-bounds.x, -bounds.y);
+        for (Shape* shape : CullOccluded(selection)) {
+            shape->Draw(memDC);
+        }
+        memDC.SelectObject(wxNullBitmap);
+        return bitmap;
+    }
+
+    // wxSVGFileDC only writes files, so render into a temporary one and read it back
+    std::string RenderSelectionSvg(const wxRect& bounds) {
+        wxString path = wxFileName::CreateTempFileName("paint");
+        if (path.IsEmpty()) {
+            return std::string();
+        }
+        {
+            wxSVGFileDC svgDC(path, std::max(bounds.width, 1), std::max(bounds.height, 1));
+            svgDC.SetDeviceOrigin(-bounds.x, -bounds.y);
+            for (Shape* shape : CullOccluded(selection)) {
+                shape->Draw(svgDC);
+            }
+        }
+        std::ifstream file(path.fn_str(), std::ios::binary);
+        std::string svg((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        wxRemoveFile(path);
+        return svg;
+    }
+
+    void ClearRedo() {
+        for (HistoryEntry& entry : redoStack) {
+            for (Shape* shape : entry.shapes) {
+                delete shape;
+            }
+        }
+        redoStack.clear();
+    }
+
+    // Bring the cache up to date where shapes appeared or went away; many at once just drop their tiles
+    void RepaintShapes(const std::vector<Shape*>& changed) {
+        if (changed.size() < bulkInsertSize) {
+            for (Shape* shape : changed) {
+                RepaintCacheRegion(shape->GetBounds());
+            }
+            return;
+        }
+        wxRect dirty;
+        for (Shape* shape : changed) {
+            dirty.Union(shape->GetBounds());
+        }
+        tiles.Invalidate(dirty);
+        RefreshDocument(dirty);
+    }
+
+    // Redraw the shapes overlapping rect into the cached tiles, for content that changes after commit
+    void RepaintCacheRegion(const wxRect& rect) {
+        if (RedrawHeatTiles(rect)) {
+            RefreshDocument(rect);
+            return;
+        }
+        wxMemoryDC memDC;
+        for (int scale : tiles.GetScales()) {
+            for (int row = FloorDiv(rect.y, CanvasTileCache::tileSize); row <= FloorDiv(rect.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                for (int column = FloorDiv(rect.x, CanvasTileCache::tileSize); column <= FloorDiv(rect.GetRight(), CanvasTileCache::tileSize); ++column) {
+                    wxBitmap* bitmap = tiles.Peek(column, row, scale);
+                    if (!bitmap) {
+                        continue;
+                    }
+                    wxRect tile = CanvasTileCache::GetTileRect(column, row);
+                    wxRect area = rect.Intersect(tile);
+                    memDC.SelectObject(*bitmap);
+                    memDC.SetDeviceOrigin(-tile.x, -tile.y);
+                    memDC.SetClippingRegion(area);
+                    memDC.SetPen(*wxTRANSPARENT_PEN);
+                    memDC.SetBrush(wxBrush(GetBackgroundColour()));
+                    memDC.DrawRectangle(area);
+                    std::vector<Shape*> drawn;
+                    if (const std::vector<ShapeGrid::Entry>* cell = grid.GetCell(column, row)) {
+                        for (const ShapeGrid::Entry& entry : *cell) {
+                            if (!entry.hidden && entry.shape->GetBounds().Intersects(area)) {
+                                drawn.push_back(entry.shape);
+                            }
+                        }
+                    }
+                    DrawTileShapes(memDC, tile, area, drawn);
+                    memDC.DestroyClippingRegion();
+                }
+            }
+        }
+        RefreshDocument(rect);
+    }
+
+    // Replace the document with the one in path; undo history starts empty. The shapes arrive over
+    // the following event turns, a time slice at a time, and the canvas can be panned from the first
+    bool OpenDocument(const wxString& path) {
+        Journal opened;
+        if (!opened.StartLoad(path)) {
+            return false;
+        }
+        CancelGestures();
+        AbandonCompaction();
+        SetSelection(std::vector<Shape*>());
+        StoreTiles(true); // For the document being replaced
+        for (Shape* shape : shapes) {
+            delete shape;
+        }
+        shapes.clear();
+        undoStack.clear();
+        ClearRedo();
+        grid.Clear();
+        journal = std::move(opened);
+        tiles.Clear();
+        packCurrent = tilePack.Open(path + ".tiles", journal.GetFileLength(), wxFileModificationTime(path), batchedRendering);
+        freshTiles = 0;
+        packUnchecked = false;
+        prefetcher.Clear();
+        scroll = wxPoint();
+        loadTiming = LoadTiming();
+        loadTiming.clock.Start();
+        ++loadGeneration;
+        if (packCurrent) {
+            CheckTilePack();
+        }
+        ContinueLoading(); // The first slice now, so the first frame has something in it
+        Refresh(false);
+        return true;
+    }
+
+    // The pack was matched on the file's length and modification time alone; hash the file on a worker
+    // and, if it is not what the pack was drawn from, drop the pack and every tile that may have come
+    // from it. Tiles are not stored until the answer is in
+    void CheckTilePack() {
+        wxString path = journal.GetPath();
+        size_t length = journal.GetFileLength();
+        unsigned long long expected = tilePack.GetDocumentHash();
+        std::weak_ptr<char> guard = alive;
+        int generation = loadGeneration;
+        packUnchecked = true;
+        GetWorkerPool().Submit([this, guard, generation, path, length, expected] {
+            unsigned long long hash;
+            bool matches = TilePack::HashDocument(path, length, hash) && hash == expected;
+            wxTheApp->CallAfter([this, guard, generation, matches] {
+                if (guard.expired() || generation != loadGeneration) {
+                    return;
+                }
+                packUnchecked = false;
+                if (!matches) {
+                    tilePack.Close();
+                    packCurrent = false;
+                    tiles.Clear();
+                    Refresh(false);
+                }
+            });
+        }, workGroup);
+    }
+
+    // Replay the next slice of the document being opened and schedule the one after. Tiles the new
+    // shapes touch are dropped and drawn again by the next paint, which keeps to the visible ones
+    void ContinueLoading() {
+        std::vector<Shape*> added;
+        int removed = 0;
+        bool more = journal.ContinueLoad(paintBudget, added, removed);
+        AddLoaded(added, removed);
+        if (loadTiming.firstSlice < 0) {
+            loadTiming.firstSlice = loadTiming.clock.Time();
+        }
+        if (!more) {
+            LoadFinished();
+            return;
+        }
+        std::weak_ptr<char> guard = alive;
+        int generation = loadGeneration;
+        wxTheApp->CallAfter([this, guard, generation] {
+            if (!guard.expired() && generation == loadGeneration && journal.IsLoading()) {
+                ContinueLoading();
+            }
+        });
+    }
+
+    // Replay the rest of the document now, for edits and saves, which need all of it. Still a slice
+    // at a time, so cold strokes page out as they arrive
+    void FinishLoading() {
+        if (journal.IsLoading()) {
+            bool more = true;
+            while (more) {
+                std::vector<Shape*> added;
+                int removed = 0;
+                more = journal.ContinueLoad(paintBudget, added, removed);
+                AddLoaded(added, removed);
+            }
+            LoadFinished();
+        }
+    }
+
+    // The view and a screen around it, where strokes are kept in memory
+    wxRect GetWarmArea() const {
+        wxRect warm(scroll, GetClientSize());
+        warm.Inflate(warm.width, warm.height);
+        return warm;
+    }
+
+    // Take a slice of loaded shapes. Once the pager is over budget, strokes away from the view are
+    // paged out on arrival, so a document larger than memory can be opened
+    void AddLoaded(std::vector<Shape*>& added, int removed) {
+        wxRect dirty;
+        for (; removed > 0 && !shapes.empty(); --removed) {
+            Shape* shape = shapes.back();
+            shapes.pop_back();
+            grid.RemoveNewest(shape);
+            tiles.Invalidate(shape->GetBounds());
+            dirty.Union(shape->GetBounds());
+            delete shape;
+        }
+        wxRect warm = GetWarmArea();
+        for (Shape* shape : added) {
+            if (ImageShape* image = dynamic_cast<ImageShape*>(shape)) {
+                image->SetOwner([this](const wxRect& rect) { RepaintCacheRegion(rect); },
+                                [this](Shape* resized, const wxRect& before) { grid.Rebucket(resized, before); }, workGroup);
+            }
+            else if (FreehandLine* line = dynamic_cast<FreehandLine*>(shape)) {
+                line->SetOwner(strokeRepaint);
+                if (GetPointPager().GetResidentBytes() > GetPointPager().budget && !line->GetBounds().Intersects(warm)) {
+                    line->Evict();
+                }
+            }
+            tiles.Invalidate(shape->GetBounds());
+            dirty.Union(shape->GetBounds());
+        }
+        shapes.insert(shapes.end(), added.begin(), added.end());
+        if (added.size() >= bulkInsertSize) {
+            grid.AddAll(added, true);
+        }
+        else {
+            for (Shape* shape : added) {
+                grid.Add(shape);
+            }
+        }
+        RefreshDocument(dirty);
+    }
+
+    void LoadFinished() {
+        loadTiming.loaded = loadTiming.clock.Time();
+        loadTiming.shapes = shapes.size();
+        GetIdleScheduler().Poke();
+    }
+
+    // First slice, first frame, all shapes in and first frame without blank tiles, for the last open
+    wxString DescribeLoading() const {
+        if (loadTiming.firstSlice < 0) {
+            return "No drawing opened in this tab";
+        }
+        auto format = [](long milliseconds) {
+            return milliseconds < 0 ? wxString("not yet") : wxString::Format("%ld ms", milliseconds);
+        };
+        return wxString::Format("%zu shapes\n", loadTiming.shapes) + "First slice: " + format(loadTiming.firstSlice) +
+            "\nFirst paint: " + format(loadTiming.firstPaint) + "\nAll shapes loaded: " + format(loadTiming.loaded) +
+            "\nFirst complete paint after loading: " + format(loadTiming.completePaint);
+    }
+
+    // Saving the file the document came from appends only the journal; the thumbnail follows in the background
+    bool SaveDocument(const wxString& path) {
+        FinishLoading();
+        if (!journal.Save(path, shapes)) {
+            return false;
+        }
+        RefreshThumbnail();
+        StoreTiles(true);
+        GetIdleScheduler().Poke(); // The journal may now be worth compacting
+        return true;
+    }
+
+    // Page out the points of strokes away from the view, oldest first, for a slice of time while the
+    // pager holds more than limit. The view and a screen around it, the selection and the newest strokes,
+    // the likeliest to be edited, stay. Returns true while there is more to do
+    bool EvictColdStrokes(size_t limit) {
+        PointPager& pager = GetPointPager();
+        size_t oldest = shapes.size() - std::min(shapes.size(), static_cast<size_t>(recentStrokes));
+        if (pager.GetResidentBytes() <= limit || oldest == 0) {
+            return false;
+        }
+        wxRect warm = GetWarmArea();
+        wxStopWatch watch;
+        for (size_t scanned = 0; scanned < oldest; ++scanned) {
+            if (watch.Time() >= tileSliceTime) {
+                return true;
+            }
+            if (evictCursor >= oldest) {
+                evictCursor = 0;
+            }
+            FreehandLine* line = dynamic_cast<FreehandLine*>(shapes[evictCursor++]);
+            if (line && !line->GetBounds().Intersects(warm) && std::find(selection.begin(), selection.end(), line) == selection.end() &&
+                line->Evict() && pager.GetResidentBytes() <= limit) {
+                return false;
+            }
+        }
+        return false; // Everything left is in use
+    }
+
+    // Write the cached tiles next to the saved document, most recently used first, followed by what
+    // the pack opened with still holds, up to TilePack::sizeLimit. Tiles showing images are left
+    // out, since the image files can change without the document changing. Does nothing when the
+    // pack on disk already has everything drawn, or while tiles may still hold stroke placeholders
+    void StoreTiles(bool inBackground) {
+        if ((packCurrent && freshTiles == 0) || packUnchecked || journal.IsLoading() || GetPointPager().pendingReads > 0 || journal.GetPath().IsEmpty() || journal.IsModified() || heatmapMode != HEATMAP_NONE) {
+            return;
+        }
+        std::shared_ptr<std::vector<PackedTile>> packed = std::make_shared<std::vector<PackedTile>>();
+        std::set<std::tuple<int, int, int>> included;
+        size_t bytes = 0;
+        auto include = [&](PackedTile& tile) {
+            if (bytes < TilePack::sizeLimit && !ShowsImage(tile.column, tile.row) &&
+                included.insert(std::make_tuple(tile.column, tile.row, tile.scale)).second) {
+                bytes += tile.rgb.size();
+                packed->push_back(std::move(tile));
+            }
+        };
+        tiles.ForEachRecent([&](int column, int row, int scale, const wxBitmap& bitmap) {
+            wxImage image = bitmap.ConvertToImage();
+            PackedTile tile;
+            tile.column = column;
+            tile.row = row;
+            tile.scale = scale;
+            tile.width = image.GetWidth();
+            tile.height = image.GetHeight();
+            tile.rgb.assign(image.GetData(), image.GetData() + static_cast<size_t>(tile.width) * tile.height * 3);
+            include(tile);
+        });
+        tilePack.ForEach(include);
+        wxString path = journal.GetPath();
+        size_t length = journal.GetFileLength();
+        bool batched = batchedRendering;
+        auto write = [path, length, batched, packed] {
+            unsigned long long hash;
+            if (TilePack::HashDocument(path, length, hash)) {
+                TilePack::Write(path + ".tiles", length, wxFileModificationTime(path), hash, batched, *packed);
+            }
+        };
+        if (inBackground) {
+            GetWorkerPool().Submit(write, workGroup);
+        }
+        else {
+            write();
+        }
+        packCurrent = true;
+        freshTiles = 0;
+    }
+
+    bool ShowsImage(int column, int row) const {
+        if (const std::vector<ShapeGrid::Entry>* cell = grid.GetCell(column, row)) {
+            for (const ShapeGrid::Entry& entry : *cell) {
+                if (dynamic_cast<ImageShape*>(entry.shape)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void RefreshThumbnail() {
+        wxString path = journal.GetPath();
+        GetWorkerPool().Submit([path] {
+            Thumbnail thumbnail;
+            GenerateThumbnail(path, thumbnail);
+        }, workGroup);
+    }
+
+    // One step of idle upkeep for this document; returns true while more remains
+    bool DoIdleWork() {
+        if (selecting || currentLine || previewShape || !polygonPoints.empty()) {
+            return false; // Poked again when the gesture commits
+        }
+        if (journal.IsLoading()) {
+            return false; // Poked again when loading finishes
+        }
+        if (ContinueCompaction()) {
+            return true;
+        }
+        if (grid.UpdateStaleOcclusion(paintBudget)) {
+            return true;
+        }
+        if (EvictColdStrokes(GetPointPager().budget)) {
+            return true;
+        }
+        // Warm image tiles nearest the window first
+        wxRect viewport(scroll, GetClientSize());
+        for (Shape* shape : shapes) {
+            ImageShape* image = dynamic_cast<ImageShape*>(shape);
+            if (image && image->WarmTile(viewport)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    typedef std::vector<std::pair<const Shape*, const Shape*>> CellChains;
+
+    static unsigned GetHilbertKey(const Shape* shape) {
+        wxRect bounds = shape->GetBounds();
+        return HilbertKey(bounds.x + bounds.width / 2, bounds.y + bounds.height / 2);
+    }
+
+    // Each grid cell's entries chained first to last; the chains form the order a layout must keep
+    CellChains GetCellChains() const {
+        CellChains chains;
+        grid.ForEachCell([&](const std::vector<ShapeGrid::Entry>& cell) {
+            for (size_t i = 1; i < cell.size(); ++i) {
+                chains.emplace_back(cell[i - 1].shape, cell[i].shape);
+            }
+        });
+        return chains;
+    }
+
+    // Document order with shapes that never share a grid cell sorted along a Hilbert curve, so shapes
+    // near each other on the page end up near each other in memory and in the file. Every cell keeps
+    // the relative order of its entries, and overlapping shapes always share a cell, so no shape moves
+    // above or below one it overlaps. Returns indices into document. Works only from the keys and
+    // chains gathered beforehand and never touches a shape, so it can run on a worker
+    static std::vector<size_t> GetHilbertOrder(const std::vector<Shape*>& document, const std::vector<unsigned>& keys, const CellChains& chains) {
+        size_t count = document.size();
+        std::unordered_map<const Shape*, size_t> index;
+        index.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            index[document[i]] = i;
+        }
+        std::vector<std::pair<size_t, size_t>> edges;
+        edges.reserve(chains.size());
+        for (const auto& chain : chains) {
+            edges.emplace_back(index[chain.first], index[chain.second]);
+        }
+        std::sort(edges.begin(), edges.end());
+        std::vector<size_t> firstEdge(count + 1, 0);
+        std::vector<size_t> waitingOn(count, 0);
+        for (const auto& edge : edges) {
+            ++firstEdge[edge.first + 1];
+            ++waitingOn[edge.second];
+        }
+        for (size_t i = 0; i < count; ++i) {
+            firstEdge[i + 1] += firstEdge[i];
+        }
+
+        // Of the shapes whose predecessors are all placed, take the lowest on the curve next
+        typedef std::pair<unsigned, size_t> Ready;
+        std::priority_queue<Ready, std::vector<Ready>, std::greater<Ready>> ready;
+        for (size_t i = 0; i < count; ++i) {
+            if (waitingOn[i] == 0) {
+                ready.emplace(keys[i], i);
+            }
+        }
+        std::vector<size_t> ordered;
+        ordered.reserve(count);
+        while (!ready.empty()) {
+            size_t next = ready.top().second;
+            ready.pop();
+            ordered.push_back(next);
+            for (size_t e = firstEdge[next]; e < firstEdge[next + 1]; ++e) {
+                if (--waitingOn[edges[e].second] == 0) {
+                    ready.emplace(keys[edges[e].second], edges[e].second);
+                }
+            }
+        }
+        return ordered;
+    }
+
+    // Put the document in Hilbert order and recreate its shapes in that order, so each shape's record
+    // and point data are allocated next to its neighbours'. All at once, for the layout benchmark;
+    // idle upkeep does the same in slices through ContinueCompaction
+    void LayOutShapes() {
+        AbandonCompaction();
+        SetSelection(std::vector<Shape*>());
+        std::vector<unsigned> keys;
+        keys.reserve(shapes.size());
+        for (Shape* shape : shapes) {
+            keys.push_back(GetHilbertKey(shape));
+        }
+        std::vector<Shape*> laidOut;
+        laidOut.reserve(shapes.size());
+        ShapeWriter out;
+        GetPointStore().BeginRelocation();
+        for (size_t index : GetHilbertOrder(shapes, keys, GetCellChains())) {
+            out.bytes.clear();
+            Shape* copy = Recreate(shapes[index], out);
+            if (copy) {
+                delete shapes[index];
+            }
+            laidOut.push_back(copy ? copy : shapes[index]);
+        }
+        shapes = laidOut;
+        grid.Clear();
+        grid.AddAll(shapes);
+    }
+
+    // Write shape to out, and unless it is an image, which keeps its object and pixels, or a paged-out
+    // stroke, which stays out, read a fresh copy back from what was written. Call between
+    // PointStore::BeginRelocation and the end of the layout
+    Shape* Recreate(Shape* shape, ShapeWriter& out) {
+        size_t start = out.bytes.size();
+        shape->Write(out);
+        FreehandLine* line = dynamic_cast<FreehandLine*>(shape);
+        if (dynamic_cast<ImageShape*>(shape) || (line && !line->IsResident())) {
+            return nullptr;
+        }
+        ShapeReader in(out.bytes.data() + start, out.bytes.size() - start);
+        Shape* copy = ReadShape(in);
+        if (FreehandLine* recreated = dynamic_cast<FreehandLine*>(copy)) {
+            recreated->Relocate(); // Reading found the original's buffer; the copy's points go next to its record
+            recreated->SetOwner(strokeRepaint); // Pages back in off the UI thread, like the original
+        }
+        return copy;
+    }
+
+    // One step of compacting the journal, rewriting the file with only the live shapes and, with no
+    // history to keep in order, laying them out along the Hilbert curve. Keys are gathered in slices,
+    // the order is worked out on a worker, the shapes are serialized and recreated in slices and the
+    // new grid is built beside the old one a chunk at a time; nothing the canvas shows changes until
+    // the last step swaps it all in. Any edit on the way abandons the work. Returns true if it did a step
+    bool ContinueCompaction() {
+        Compaction& work = compaction;
+        if (work.stage != Compaction::IDLE && work.edits != journal.GetEditCount()) {
+            AbandonCompaction();
+        }
+        wxStopWatch watch;
+        switch (work.stage) {
+        case Compaction::IDLE:
+            if (work.failedAt == journal.GetEditCount() || !journal.NeedsCompaction(shapes.size())) {
+                return false;
+            }
+            work.edits = journal.GetEditCount();
+            work.source = shapes;
+            work.layOut = undoStack.empty() && redoStack.empty(); // Undo relies on the newest shapes being last
+            work.next = 0;
+            Journal::WriteHeader(work.file);
+            work.stage = work.layOut ? Compaction::KEYS : Compaction::SERIALIZE;
+            return true;
+        case Compaction::KEYS:
+            while (work.next < work.source.size() && (work.next % 1024 != 0 || watch.Time() < tileSliceTime)) {
+                work.keys.push_back(GetHilbertKey(work.source[work.next++]));
+            }
+            if (work.next == work.source.size()) {
+                StartCompactionOrder();
+                GetPointStore().BeginRelocation();
+            }
+            return true;
+        case Compaction::ORDER:
+            return false; // The worker pokes the scheduler when the order is in
+        case Compaction::SERIALIZE:
+            while (work.next < work.source.size() && (work.next % 64 != 0 || watch.Time() < tileSliceTime)) {
+                Shape* shape = work.source[work.order.empty() ? work.next : work.order[work.next]];
+                ++work.next;
+                work.file.WriteByte(RECORD_ADD);
+                if (!work.layOut) {
+                    shape->Write(work.file);
+                    continue;
+                }
+                Shape* copy = Recreate(shape, work.file);
+                work.laidOut.push_back(copy ? copy : shape);
+                work.recreated.push_back(copy != nullptr);
+            }
+            if (work.next == work.source.size()) {
+                work.next = 0;
+                work.stage = work.layOut ? Compaction::GRID : Compaction::FINISH;
+            }
+            return true;
+        case Compaction::GRID: {
+            size_t end = std::min(work.laidOut.size(), work.next + compactionGridChunk);
+            work.grid.AddAll(std::vector<Shape*>(work.laidOut.begin() + work.next, work.laidOut.begin() + end), true);
+            work.next = end;
+            if (work.next == work.laidOut.size()) {
+                work.stage = Compaction::FINISH;
+            }
+            return true;
+        }
+        case Compaction::FINISH:
+            if (!journal.Replace(journal.GetPath(), work.file, work.source.size())) {
+                size_t edits = work.edits;
+                AbandonCompaction();
+                compaction.failedAt = edits; // Tried again after the next edit
+                return true;
+            }
+            if (work.layOut) {
+                SetSelection(std::vector<Shape*>());
+                for (size_t i = 0; i < work.laidOut.size(); ++i) {
+                    if (work.recreated[i]) {
+                        delete work.source[work.order[i]];
+                    }
+                }
+                shapes.swap(work.laidOut);
+                std::swap(grid, work.grid); // Cells left for UpdateStaleOcclusion come along
+                evictCursor = 0;
+            }
+            compaction = Compaction();
+            RefreshThumbnail();
+            packCurrent = false; // Drawn the same, but under a new file hash
+            return true;
+        }
+        return false;
+    }
+
+    // Gather the cell chains and work out the Hilbert order on a worker
+    void StartCompactionOrder() {
+        compaction.stage = Compaction::ORDER;
+        std::shared_ptr<std::vector<Shape*>> document = std::make_shared<std::vector<Shape*>>(compaction.source);
+        std::shared_ptr<std::vector<unsigned>> keys = std::make_shared<std::vector<unsigned>>(std::move(compaction.keys));
+        std::shared_ptr<CellChains> chains = std::make_shared<CellChains>(GetCellChains());
+        std::weak_ptr<char> guard = alive;
+        int generation = ++compactionGeneration;
+        GetWorkerPool().Submit([this, guard, generation, document, keys, chains] {
+            std::shared_ptr<std::vector<size_t>> order = std::make_shared<std::vector<size_t>>(GetHilbertOrder(*document, *keys, *chains));
+            wxTheApp->CallAfter([this, guard, generation, order] {
+                if (!guard.expired() && compaction.stage == Compaction::ORDER && compactionGeneration == generation) {
+                    compaction.order = std::move(*order);
+                    compaction.stage = Compaction::SERIALIZE;
+                    GetIdleScheduler().Poke();
+                }
+            });
+        }, workGroup);
+    }
+
+    // Drop the copies made so far; the document keeps its shapes as they are
+    void AbandonCompaction() {
+        for (size_t i = 0; i < compaction.laidOut.size(); ++i) {
+            if (compaction.recreated[i]) {
+                delete compaction.laidOut[i];
+            }
+        }
+        compaction = Compaction();
+        ++compactionGeneration;
+    }
+
+    // Walk the shapes in view along a pan trace, reading each one's record and points, and count cache
+    // misses before and after LayOutShapes. Without a recorded trace the view sweeps the document
+    void RunLayoutBenchmark() {
+        FinishLoading();
+        if (!undoStack.empty() || !redoStack.empty()) {
+            wxMessageBox("Save and reopen the drawing first; reordering needs an empty undo history.", "Layout Benchmark", wxOK | wxICON_INFORMATION, this);
+            return;
+        }
+        std::vector<wxPoint> positions;
+        for (const auto& step : panTrace) {
+            positions.push_back(step.second);
+        }
+        if (positions.size() < 2) {
+            wxRect extent;
+            for (Shape* shape : shapes) {
+                extent.Union(shape->GetBounds());
+            }
+            for (int y = extent.y; y <= extent.GetBottom(); y += CanvasTileCache::tileSize) {
+                for (int x = extent.x; x <= extent.GetRight(); x += CanvasTileCache::tileSize / 4) {
+                    positions.emplace_back(x, y);
+                }
+            }
+        }
+        wxString report = wxString::Format("%zu shapes, %zu view positions\n", shapes.size(), positions.size());
+        for (int pass = 0; pass < 2; ++pass) {
+            if (pass == 1) {
+                wxStopWatch layoutWatch;
+                LayOutShapes();
+                report += wxString::Format("Hilbert layout: %ld ms\n", layoutWatch.Time());
+            }
+            CacheMissCounter misses;
+            ShapeWriter out;
+            size_t visited = 0;
+            wxStopWatch watch;
+            misses.Start();
+            for (const wxPoint& position : positions) {
+                for (Shape* shape : grid.Query(wxRect(position, GetClientSize()))) {
+                    out.bytes.clear();
+                    shape->Write(out); // Touches the record and all of its point data
+                    ++visited;
+                }
+            }
+            long long missCount = misses.IsOk() ? misses.Stop() : -1;
+            report += wxString::Format("%s: %ld ms, %zu shapes visited, ", pass == 0 ? "Insertion order" : "Hilbert order", watch.Time(), visited);
+            report += misses.IsOk() ? wxString::Format("%lld cache misses\n", missCount) : wxString("cache misses unavailable\n");
+        }
+        Refresh(false);
+        wxMessageBox(report, "Layout Benchmark", wxOK | wxICON_INFORMATION, this);
+    }
+
+    // Build a million circles from coordinate arrays and insert them into this document as one step,
+    // which can be undone to get rid of them again
+    void RunBatchBenchmark() {
+        const int benchmarkCount = 1000000;
+        srand(1234);
+        std::vector<wxPoint> centres(benchmarkCount);
+        std::vector<int> radii(benchmarkCount);
+        for (int i = 0; i < benchmarkCount; ++i) {
+            centres[i] = wxPoint(rand() % 20000, rand() % 20000);
+            radii[i] = 2 + rand() % 30;
+        }
+        wxStopWatch watch;
+        ShapeBatch batch;
+        batch.AddCircles(centres.data(), radii.data(), centres.size(), *wxBLUE);
+        long built = watch.Time();
+        watch.Start();
+        InsertBatch(batch);
+        long inserted = watch.Time();
+        watch.Start();
+        Update();
+        wxMessageBox(wxString::Format("%d circles\nBuild: %ld ms\nInsert: %ld ms\nFirst paint: %ld ms",
+            benchmarkCount, built, inserted, watch.Time()), "Batch Insert Benchmark", wxOK | wxICON_INFORMATION, this);
+    }
+
+    // Index a million generated shapes one at a time and with the bulk loader
+    void RunIndexBenchmark() {
+        const int benchmarkCount = 1000000;
+        const ShapeTool kinds[5] = { TOOL_CIRCLE, TOOL_SQUARE, TOOL_ELLIPSE, TOOL_LINE, TOOL_RECTANGLE };
+        wxSize area(20000, 20000);
+        srand(1234);
+        std::vector<Shape*> batch;
+        batch.reserve(benchmarkCount);
+        for (int i = 0; i < benchmarkCount; ++i) {
+            batch.push_back(CreateBenchmarkShape(kinds[i % 5], area, wxColor(rand() % 256, rand() % 256, rand() % 256)));
+        }
+        wxString report = wxString::Format("%d shapes, %u cores\n", benchmarkCount, std::max(1u, std::thread::hardware_concurrency()));
+        {
+            ShapeGrid index;
+            wxStopWatch watch;
+            for (Shape* shape : batch) {
+                index.Add(shape);
+            }
+            report += wxString::Format("One at a time: %ld ms, %zu hidden\n", watch.Time(), index.GetHiddenCount());
+        }
+        {
+            ShapeGrid index;
+            wxStopWatch watch;
+            index.AddAll(batch);
+            report += wxString::Format("Bulk load: %ld ms, %zu hidden\n", watch.Time(), index.GetHiddenCount());
+        }
+        for (Shape* shape : batch) {
+            delete shape;
+        }
+        wxMessageBox(report, "Index Benchmark", wxOK | wxICON_INFORMATION, this);
+    }
+
+    const wxString& GetPath() const {
+        return journal.GetPath();
+    }
+
+    wxString GetTitle() const {
+        return journal.GetPath().IsEmpty() ? wxString("Untitled") : wxFileName(journal.GetPath()).GetFullName();
+    }
+
+    bool IsModified() const {
+        return journal.IsModified();
+    }
+
+    // Where a document is scrolled to and how it draws, kept between sessions
+    struct ViewState {
+        wxPoint scroll;
+        ShapeTool tool = TOOL_NONE;
+        wxColor color = *wxBLACK;
+        bool rainbow = false;
+        bool eraser = false;
+    };
+
+    ViewState GetViewState() const {
+        ViewState state;
+        state.scroll = scroll;
+        state.tool = shapeTool;
+        state.color = currentColor;
+        state.rainbow = rainbowMode;
+        state.eraser = eraserMode;
+        return state;
+    }
+
+    void SetViewState(const ViewState& state) {
+        SetShapeTool(state.tool);
+        currentColor = state.color;
+        rainbowMode = state.rainbow;
+        eraserMode = state.eraser;
+        scroll = state.scroll;
+        prefetcher.Clear();
+        Refresh(false);
+    }
+
+    // A fresh document nobody has drawn on, which opening a file may replace
+    bool IsUntouched() const {
+        return journal.GetPath().IsEmpty() && shapes.empty() && undoStack.empty() && redoStack.empty();
+    }
+
+    // Hidden documents keep their state, but their background work waits for the visible one
+    void SetDocumentVisible(bool visible) {
+        workGroup->visible = visible;
+        tiles.SetHidden(!visible);
+    }
+
+    size_t GetCacheBytes() const {
+        return tiles.GetMemoryBytes();
+    }
+
+    // Give the rendered tiles back; the next paint renders the visible ones again
+    void ReleaseCache() {
+        tiles.Clear();
+    }
+
+    void Save() {
+        if (journal.GetPath().IsEmpty()) {
+            SaveAs();
+        }
+        else if (!SaveDocument(journal.GetPath())) {
+            wxMessageBox("Could not write " + journal.GetPath(), "Save Drawing", wxOK | wxICON_INFORMATION, this);
+        }
+    }
+
+    void SaveAs() {
+        wxFileDialog dialog(this, "Save Drawing", "", "", "Drawings (*.pnt)|*.pnt", wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+        if (dialog.ShowModal() == wxID_OK && !SaveDocument(dialog.GetPath())) {
+            wxMessageBox("Could not write " + dialog.GetPath(), "Save Drawing", wxOK | wxICON_INFORMATION, this);
+        }
+    }
+
+    void ImportImage() {
+        wxFileDialog dialog(this, "Import Image", "", "", "Images (*.png;*.jpg;*.jpeg;*.bmp)|*.png;*.jpg;*.jpeg;*.bmp", wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+        if (dialog.ShowModal() == wxID_OK) {
+            CommitShape(new ImageShape(wxPoint(10, 10), dialog.GetPath()));
+        }
+    }
+
+    // Build the shape for a drag from dragStart to end; a plain click keeps the fixed shapeSize
+    Shape* CreateDragShape(const wxPoint& end) const {
+        int dx = end.x - dragStart.x;
+        int dy = end.y - dragStart.y;
+        bool clicked = std::abs(dx) < 3 && std::abs(dy) < 3;
+        wxRect box = clicked ? wxRect(dragStart, wxSize(shapeSize, shapeSize))
+                             : wxRect(wxPoint(std::min(dragStart.x, end.x), std::min(dragStart.y, end.y)),
+                                      wxPoint(std::max(dragStart.x, end.x), std::max(dragStart.y, end.y)));
+        switch (shapeTool) {
+        case TOOL_CIRCLE: {
+            int radius = clicked ? shapeSize : static_cast<int>(std::lround(std::hypot(dx, dy)));
+            return new Circle(dragStart, radius, currentColor);
+        }
+        case TOOL_SQUARE: {
+            if (clicked) {
+                return new Square(dragStart, shapeSize, currentColor);
+            }
+            // Square grows from the press point towards the cursor in any direction
+            int side = std::max(std::abs(dx), std::abs(dy));
+            wxPoint topLeft(dx < 0 ? dragStart.x - side : dragStart.x, dy < 0 ? dragStart.y - side : dragStart.y);
+            return new Square(topLeft, side, currentColor);
+        }
+        case TOOL_ELLIPSE:
+            return new EllipseShape(clicked ? wxRect(dragStart, wxSize(2 * shapeSize, shapeSize)) : box, currentColor);
+        case TOOL_LINE:
+            return new LineShape(dragStart, clicked ? dragStart + wxPoint(shapeSize, 0) : end, currentColor);
+        default:
+            return new RectangleShape(box, currentColor);
+        }
+    }
+
+    // Polygon placed so far, with a rubber band edge to the cursor
+    void UpdatePolygonPreview(const wxPoint& cursor) {
+        std::vector<wxPoint> points = polygonPoints;
+        points.push_back(cursor);
+        UpdatePreview(new PolygonShape(points, currentColor));
+    }
+
+    // Commit the polygon once it has enough vertices to enclose an area
+    void FinishPolygon() {
+        if (previewShape) {
+            RefreshDocument(previewShape->GetBounds());
+            delete previewShape;
+            previewShape = nullptr;
+        }
+        if (polygonPoints.size() > 2) {
+            CommitShape(new PolygonShape(polygonPoints, currentColor));
+        }
+        polygonPoints.clear();
+    }
+
+    // Render benchmarkCount shapes of each kind off-screen and report the time per kind
+    void RunRenderBenchmark() {
+        const int benchmarkCount = 20000;
+        const char* names[TOOL_TEXT + 1] = { "Freehand", "Circle", "Square", "Ellipse", "Line", "Rectangle", "Polygon", "Text" };
+        wxSize area(1024, 768);
+        wxBitmap target(area.x, area.y);
+        wxMemoryDC memDC(target);
+        wxString report;
+        for (int kind = TOOL_NONE; kind <= TOOL_TEXT; ++kind) {
+            srand(1234); // Same layout on every run
+            std::vector<Shape*> batch;
+            batch.reserve(benchmarkCount);
+            for (int i = 0; i < benchmarkCount; ++i) {
+                batch.push_back(CreateBenchmarkShape(static_cast<ShapeTool>(kind), area, wxColor(rand() % 256, rand() % 256, rand() % 256)));
+            }
+            memDC.SetBackground(*wxWHITE_BRUSH);
+            memDC.Clear();
+            wxStopWatch watch;
+            for (Shape* shape : batch) {
+                shape->Draw(memDC);
+            }
+            report += wxString::Format("%s: %d shapes in %ld ms\n", names[kind], benchmarkCount, watch.Time());
+            for (Shape* shape : batch) {
+                delete shape;
+            }
+        }
+
+        // Baseline for the glyph cache: the same words through DrawText
+        srand(1234);
+        memDC.Clear();
+        memDC.SetFont(*wxNORMAL_FONT);
+        wxStopWatch watch;
+        for (int i = 0; i < benchmarkCount; ++i) {
+            memDC.DrawText(benchmarkWords[rand() % 6], rand() % area.x, rand() % area.y);
+        }
+        report += wxString::Format("Text (DrawText): %d shapes in %ld ms\n", benchmarkCount, watch.Time());
+        wxMessageBox(report, "Render Benchmark", wxOK | wxICON_INFORMATION, this);
+    }
+
+    // Time redrawing the visible tiles at 1x and 2x, without touching the cache
+    void ReportTileRenderCost() {
+        wxRect view(scroll, GetClientSize());
+        const int scales[2] = { 100, 200 };
+        double perTile[2] = { 0, 0 };
+        int count = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            count = 0;
+            wxStopWatch watch;
+            for (int row = FloorDiv(view.y, CanvasTileCache::tileSize); row <= FloorDiv(view.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                for (int column = FloorDiv(view.x, CanvasTileCache::tileSize); column <= FloorDiv(view.GetRight(), CanvasTileCache::tileSize); ++column) {
+                    DrawTile(column, row, scales[pass]);
+                    ++count;
+                }
+            }
+            perTile[pass] = count ? watch.Time() / static_cast<double>(count) : 0;
+        }
+        wxString report = wxString::Format("Visible tiles: %d\n1x: %.2f ms/tile\n2x: %.2f ms/tile\n", count, perTile[0], perTile[1]);
+        if (perTile[0] > 0) {
+            report += wxString::Format("2x costs %.1fx of 1x\n", perTile[1] / perTile[0]);
+        }
+        report += wxString::Format("Current scale: %d%%, cache %ld KB\n", GetScalePercent(), static_cast<long>(tiles.GetMemoryBytes() / 1024));
+        wxMessageBox(report, "Tile Render Cost", wxOK | wxICON_INFORMATION, this);
+    }
+
+    // Draw circle, square and stroke heavy documents with per-shape DC calls and with batched paths
+    void RunBackendBenchmark() {
+        const int benchmarkCount = 20000;
+        const ShapeTool kinds[3] = { TOOL_CIRCLE, TOOL_SQUARE, TOOL_NONE };
+        const char* names[3] = { "Circles", "Squares", "Strokes" };
+        const wxColor palette[3] = { *wxRED, *wxGREEN, *wxBLUE }; // The Colors menu
+        wxSize area(1024, 768);
+        wxBitmap target(area.x, area.y);
+        wxMemoryDC memDC(target);
+        wxString report = "Renderer: " + GetBatchRenderer()->GetName() + "\n";
+        for (int i = 0; i < 3; ++i) {
+            srand(1234); // Same layout on every run
+            std::vector<Shape*> batch;
+            batch.reserve(benchmarkCount);
+            for (int n = 0; n < benchmarkCount; ++n) {
+                batch.push_back(CreateBenchmarkShape(kinds[i], area, palette[rand() % 3]));
+            }
+            memDC.SetBackground(*wxWHITE_BRUSH);
+            memDC.Clear();
+            wxStopWatch watch;
+            for (Shape* shape : batch) {
+                shape->Draw(memDC);
+            }
+            long perShape = watch.Time();
+
+            memDC.Clear();
+            watch.Start();
+            size_t drawCalls = 0;
+            {
+                wxGCDC gcdc(GetBatchRenderer()->CreateContext(memDC));
+                PathBatcher batcher(gcdc);
+                for (Shape* shape : batch) {
+                    batcher.Add(shape);
+                }
+                batcher.Flush();
+                drawCalls = batcher.GetDrawCalls();
+            } // The context finishes drawing when it goes away
+            report += wxString::Format("%s: wxDC %ld ms, paths %ld ms in %zu draw calls\n", names[i], perShape, watch.Time(), drawCalls);
+            for (Shape* shape : batch) {
+                delete shape;
+            }
+        }
+        wxMessageBox(report, "Backend Benchmark", wxOK | wxICON_INFORMATION, this);
+    }
+
+    // Swap the preview shape and repaint only the union of its old and new areas
+    void UpdatePreview(Shape* shape) {
+        wxRect dirty = shape->GetBounds();
+        if (previewShape) {
+            dirty.Union(previewShape->GetBounds());
+            delete previewShape;
+        }
+        previewShape = shape;
+        RefreshDocument(dirty);
+    }
+
+    // Cached tiles cover everything that stays on screen, and wx only invalidates the newly exposed
+    // strips, so a resize draws just the tiles entering the view. Tiles one step past a growing edge
+    // are queued so the next size event finds them ready
+    void OnSize(wxSizeEvent& event) {
+        wxSize size = GetClientSize();
+        tiles.ReserveFor(size, GetScalePercent());
+        wxRect view(scroll, size);
+        if (size.x > viewSize.x) {
+            int column = FloorDiv(view.GetRight(), CanvasTileCache::tileSize) + 1;
+            for (int row = FloorDiv(view.y, CanvasTileCache::tileSize); row <= FloorDiv(view.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                prefetcher.RequestAhead(column, row);
+            }
+        }
+        if (size.y > viewSize.y) {
+            int row = FloorDiv(view.GetBottom(), CanvasTileCache::tileSize) + 1;
+            for (int column = FloorDiv(view.x, CanvasTileCache::tileSize); column <= FloorDiv(view.GetRight(), CanvasTileCache::tileSize) + 1; ++column) {
+                prefetcher.RequestAhead(column, row);
+            }
+        }
+        viewSize = size;
+        sinceResize.Start();
+        ScheduleTileRendering();
+        event.Skip();
+    }
+
+    void OnPaint(wxPaintEvent& event) {
+        wxPaintDC dc(this);
+        // Copy only the damaged parts from cached tiles, rendering missing ones within the paint budget;
+        // the rest show blank this frame and are rendered right after. Live resizing gets a smaller
+        // budget so the window keeps up with the drag
+        long paintLimit = sinceResize.Time() < resizeSettleTime ? resizeBudget : paintBudget;
+        int scale = GetScalePercent();
+        wxMemoryDC tileDC;
+        wxStopWatch budget;
+        bool blank = false;
+        bool standIn = false;
+        for (wxRegionIterator it(GetUpdateRegion()); it; ++it) {
+            wxRect area = it.GetRect();
+            area.Offset(scroll);
+            for (int row = FloorDiv(area.y, CanvasTileCache::tileSize); row <= FloorDiv(area.GetBottom(), CanvasTileCache::tileSize); ++row) {
+                for (int column = FloorDiv(area.x, CanvasTileCache::tileSize); column <= FloorDiv(area.GetRight(), CanvasTileCache::tileSize); ++column) {
+                    wxRect tile = CanvasTileCache::GetTileRect(column, row);
+                    wxRect part = area;
+                    part.Intersect(tile);
+                    wxBitmap* bitmap = tiles.Find(column, row, scale);
+                    if (!bitmap && budget.Time() < paintLimit) {
+                        bitmap = &RenderTile(column, row, scale);
+                    }
+                    if (!bitmap) {
+                        // After a move to a screen of another density, the tile at the old scale stands in
+                        // (wx stretches it) until this one is drawn again
+                        bitmap = tiles.PeekOtherScale(column, row, scale);
+                        if (bitmap) {
+                            standIn = true;
+                            prefetcher.RequestNow(column, row);
+                        }
+                    }
+                    if (bitmap) {
+                        tileDC.SelectObjectAsSource(*bitmap);
+                        dc.Blit(part.x - scroll.x, part.y - scroll.y, part.width, part.height, &tileDC, part.x - tile.x, part.y - tile.y);
+                    }
+                    else {
+                        blank = true;
+                        dc.SetPen(*wxTRANSPARENT_PEN);
+                        dc.SetBrush(wxBrush(GetBackgroundColour()));
+                        dc.DrawRectangle(part.x - scroll.x, part.y - scroll.y, part.width, part.height);
+                        prefetcher.RequestNow(column, row);
+                    }
+                }
+            }
+        }
+        tileDC.SelectObject(wxNullBitmap);
+        ++paintedFrames;
+        if (blank) {
+            ++blankFrames;
+        }
+        if (loadTiming.firstSlice >= 0 && loadTiming.firstPaint < 0) {
+            loadTiming.firstPaint = loadTiming.clock.Time();
+        }
+        if (loadTiming.loaded >= 0 && loadTiming.completePaint < 0 && !blank && !standIn) {
+            loadTiming.completePaint = loadTiming.clock.Time();
+        }
+        StartupTiming& startup = GetStartupTiming();
+        if (startup.completePaint < 0) {
+            if (startup.firstPaint < 0) {
+                startup.firstPaint = startup.clock.Time();
+            }
+            if (!blank && !standIn) {
+                startup.completePaint = startup.clock.Time();
+            }
+        }
+        if (blank || standIn) {
+            ScheduleTileRendering();
+        }
+
+        dc.SetDeviceOrigin(-scroll.x, -scroll.y); // Overlays are in document coordinates
+        for (const auto& tile : liveTiles) {
+            wxRect area = CanvasTileCache::GetTileRect(tile.first.first, tile.first.second);
+            dc.DrawBitmap(tile.second.bitmap, area.GetPosition(), true); // The freehand line in progress
+        }
+        if (previewShape) {
+            previewShape->Draw(dc); // Draw the shape being sized on top of the cache
+        }
+        if (heatmapMode != HEATMAP_NONE) {
+            dc.SetTextForeground(*wxBLACK);
+            dc.DrawText(DescribeHeatmap(), scroll + wxPoint(4, 4));
+        }
+        if (!selection.empty() || selecting) {
+            dc.SetPen(*wxBLACK_DASHED_PEN);
+            dc.SetBrush(*wxTRANSPARENT_BRUSH);
+            for (Shape* shape : selection) {
+                dc.DrawRectangle(shape->GetBounds().Inflate(1));
+            }
+            if (selecting) {
+                dc.DrawRectangle(selectionBand);
+            }
+        }
+    }
+
+    void OnLeftDown(wxMouseEvent& event) {
+        GetIdleScheduler().NoteInput();
+        FinishLoading(); // Gestures work on the whole document
+        if (shapeTool == TOOL_SELECT) {
+            selecting = true;
+            dragStart = ToDocument(event.GetPosition());
+            selectionBand = wxRect(dragStart, wxSize(1, 1));
+            CaptureMouse();
+            return;
+        }
+        if (shapeTool == TOOL_POLYGON) {
+            // Each click adds a vertex; double-click closes the polygon
+            if (polygonPoints.empty() || polygonPoints.back() != ToDocument(event.GetPosition())) {
+                polygonPoints.push_back(ToDocument(event.GetPosition()));
+            }
+            UpdatePolygonPreview(ToDocument(event.GetPosition()));
+            return;
+        }
+        if (shapeTool == TOOL_TEXT) {
+            wxString text = wxGetTextFromUser("Text to place:", "Add Text", "", this);
+            if (!text.IsEmpty()) {
+                CommitShape(new TextShape(ToDocument(event.GetPosition()), text, textFont, currentColor));
+            }
+            return;
+        }
+        if (shapeTool != TOOL_NONE) {
+            // Start sizing the shape; it is committed on mouse-up
+            dragStart = ToDocument(event.GetPosition());
+            UpdatePreview(CreateDragShape(dragStart));
+            CaptureMouse();
+            return;
+        }
+        else if (eraserMode) {
+            currentLine = new FreehandLine(*wxWHITE); // Eraser draws with white color
+        }
+        else {
+            currentLine = new FreehandLine(currentColor, rainbowMode);
+        }
+        if (currentLine) {
+            liveColor = currentLine->GetColor();
+            strokes.Begin(ToDocument(event.GetPosition()), FreehandLine::penWidth);
+        }
+    }
+
+    void OnLeftUp(wxMouseEvent& event) {
+        GetIdleScheduler().NoteInput();
+        if (selecting) {
+            selecting = false;
+            wxRect dirty = selectionBand;
+            RefreshDocument(dirty.Inflate(1));
+            bool click = selectionBand.width < 3 && selectionBand.height < 3;
+            SetSelection(FindShapes(selectionBand, click));
+        }
+        if (previewShape && shapeTool != TOOL_POLYGON) {
+            Shape* shape = previewShape;
+            previewShape = nullptr;
+            CommitShape(shape); // Save the sized shape to shapes
+        }
+        if (HasCapture()) {
+            ReleaseMouse();
+        }
+        if (currentLine) {
+            FreehandLine* line = currentLine;
+            for (const wxPoint& point : FinishStroke(ToDocument(event.GetPosition()))) {
+                line->AddPoint(point);
+            }
+            currentLine = nullptr; // Reset current line
+            CommitShape(line, eraserMode ? EraseImagesUnder(*line) : HistoryEntry()); // Save the line to shapes
+        }
+    }
+
+    void OnLeftDClick(wxMouseEvent& event) {
+        if (shapeTool == TOOL_POLYGON) {
+            if (polygonPoints.empty() || polygonPoints.back() != ToDocument(event.GetPosition())) {
+                polygonPoints.push_back(ToDocument(event.GetPosition()));
+            }
+            FinishPolygon();
+        }
+        else if (!currentLine && !previewShape) {
+            OnLeftDown(event); // Ports that send no second press need it treated as one
+        }
+    }
+
+    void OnMouseMove(wxMouseEvent& event) {
+        if (event.LeftIsDown()) {
+            GetIdleScheduler().NoteInput();
+        }
+        if (panning) {
+            ScrollTo(panScrollStart - (event.GetPosition() - panStart));
+        }
+        if (selecting) {
+            wxPoint at = ToDocument(event.GetPosition());
+            wxRect band(wxPoint(std::min(dragStart.x, at.x), std::min(dragStart.y, at.y)),
+                        wxPoint(std::max(dragStart.x, at.x), std::max(dragStart.y, at.y)));
+            wxRect dirty = band;
+            dirty.Union(selectionBand);
+            RefreshDocument(dirty.Inflate(1));
+            selectionBand = band;
+        }
+        else if (shapeTool == TOOL_POLYGON) {
+            if (!polygonPoints.empty()) {
+                UpdatePolygonPreview(ToDocument(event.GetPosition()));
+            }
+        }
+        else if (previewShape) {
+            UpdatePreview(CreateDragShape(ToDocument(event.GetPosition())));
+        }
+        else if (currentLine) {
+            if (rainbowMode) {
+                currentLine->UpdateRainbowColor(); // Shown when the stroke is next presented
+            }
+            strokes.Add(ToDocument(event.GetPosition())); // Everything else happens on the stroke worker
+        }
+    }
+
+    void OnCaptureLost(wxMouseCaptureLostEvent&) {
+        if (selecting) {
+            selecting = false;
+            wxRect dirty = selectionBand;
+            RefreshDocument(dirty.Inflate(1));
+        }
+        if (previewShape) {
+            RefreshDocument(previewShape->GetBounds());
+            delete previewShape; // Abandon the drag
+            previewShape = nullptr;
+        }
+        panning = false;
+    }
+
+    // Middle-button drag pans the view
+    void OnMiddleDown(wxMouseEvent& event) {
+        panning = true;
+        panStart = event.GetPosition();
+        panScrollStart = scroll;
+        if (!HasCapture()) {
+            CaptureMouse();
+        }
+    }
+
+    void OnMiddleUp(wxMouseEvent&) {
+        panning = false;
+        if (HasCapture() && !selecting && !previewShape) {
+            ReleaseMouse();
+        }
+    }
+
+    // Wheel scrolls vertically, or horizontally with Shift
+    void OnMouseWheel(wxMouseEvent& event) {
+        int step = -event.GetWheelRotation() * 60 / std::max(event.GetWheelDelta(), 1);
+        ScrollTo(scroll + (event.ShiftDown() ? wxPoint(step, 0) : wxPoint(0, step)));
+    }
+
+    void OnReplayTimer(wxTimerEvent&) {
+        ScrollTo(panTrace[++replayStep].second);
+        Update(); // Paint now, as the frame at this moment of the pan
+        if (replayStep + 1 < panTrace.size()) {
+            replayTimer.StartOnce(std::max(1L, panTrace[replayStep + 1].first - panTrace[replayStep].first));
+            return;
+        }
+        replayBlankFrames[replayPass] = blankFrames;
+        if (replayPass == 0) {
+            replayPass = 1;
+            BeginReplayPass();
+            return;
+        }
+        replayPass = -1;
+        prefetcher.enabled = true;
+        wxMessageBox(wxString::Format("Pan trace of %d frames over %ld ms\nFrames with blank tiles without prefetching: %d\n"
+                                      "Frames with blank tiles with prefetching: %d",
+                                      static_cast<int>(panTrace.size() - 1), panTrace.back().first - panTrace.front().first,
+                                      replayBlankFrames[0], replayBlankFrames[1]),
+                     "Pan Trace", wxOK | wxICON_INFORMATION, this);
+    }
+
+    void SetColor(const wxColor& color) {
+        currentColor = color;
+        eraserMode = false; // Disable eraser mode when color is set
+        rainbowMode = false; // Disable rainbow mode when a specific color is set
+        SetShapeTool(TOOL_NONE); // Disable shape modes when a specific color is set
+    }
+
+    void EnableRainbowMode() {
+        rainbowMode = true;
+        SetShapeTool(TOOL_NONE); // Disable shape modes when rainbow is enabled
+    }
+
+    void EnableEraserMode() {
+        eraserMode = true;
+        SetShapeTool(TOOL_NONE); // Disable shape modes when eraser is enabled
+    }
+
+    void EnableCircleMode() {
+        EnableShapeMode(TOOL_CIRCLE);
+    }
+
+    void EnableSquareMode() {
+        EnableShapeMode(TOOL_SQUARE);
+    }
+
+    void EnableShapeMode(ShapeTool tool) {
+        SetShapeTool(tool);
+        eraserMode = false;  // Disable other modes
+        rainbowMode = false;
+    }
+
+private:
+    // Milliseconds of tile rendering per paint, per paint while resizing and per deferred step, and how
+    // long after a size event resizing is assumed to continue
+    enum { paintBudget = 12, resizeBudget = 3, tileSliceTime = 4, resizeSettleTime = 150 };
+    enum { bulkInsertSize = 1024 }; // Commits of at least this many shapes are indexed with ShapeGrid::AddAll
+    enum { recentStrokes = 256 };   // Newest shapes, never paged out
+    size_t evictCursor = 0;         // Where EvictColdStrokes continues from
+    enum { compactionGridChunk = 16384 }; // Shapes indexed per compaction step
+
+    // Compaction under way in idle slices; see ContinueCompaction
+    struct Compaction {
+        enum Stage { IDLE, KEYS, ORDER, SERIALIZE, GRID, FINISH };
+        Stage stage = IDLE;
+        size_t edits = 0;               // Journal edit count when it started
+        size_t failedAt = static_cast<size_t>(-1); // Edit count at which writing the file last failed
+        bool layOut = false;
+        size_t next = 0;                // Progress through the current stage
+        std::vector<Shape*> source;     // The document as it was when it started
+        std::vector<unsigned> keys;     // Hilbert keys of source
+        std::vector<size_t> order;      // Indices into source, in layout order
+        std::vector<Shape*> laidOut;
+        std::vector<char> recreated;    // Whether laidOut[i] is a copy made here, to delete if abandoned
+        ShapeWriter file;
+        ShapeGrid grid;
+    } compaction;
+    int compactionGeneration = 0;   // Orders worked out for an abandoned compaction are dropped
+
+    // Both passes start from the first position with only the visible tiles rendered
+    void BeginReplayPass() {
+        prefetcher.enabled = replayPass == 1;
+        prefetcher.Clear();
+        tiles.Clear();
+        replayStep = 0;
+        ScrollTo(panTrace[0].second);
+        wxRect view(scroll, GetClientSize());
+        for (int row = FloorDiv(view.y, CanvasTileCache::tileSize); row <= FloorDiv(view.GetBottom(), CanvasTileCache::tileSize); ++row) {
+            for (int column = FloorDiv(view.x, CanvasTileCache::tileSize); column <= FloorDiv(view.GetRight(), CanvasTileCache::tileSize); ++column) {
+                RenderTile(column, row, GetScalePercent());
+            }
+        }
+        prefetcher.Clear();
+        Refresh(false);
+        Update();
+        paintedFrames = blankFrames = 0;
+        replayTimer.StartOnce(std::max(1L, panTrace[1].first - panTrace[0].first));
+    }
+
+    // Turn the pipeline's coverage into bitmaps for the live stroke; true once the stroke has
+    // finished, with its simplified points
+    bool PresentStroke(std::vector<wxPoint>& points) {
+        strokes.Acknowledge();
+        bool finished = false;
+        StrokePipeline::Output output;
+        while (strokes.Pop(output)) {
+            if (output.kind == StrokePipeline::Output::finished) {
+                points = std::move(output.points);
+                finished = true;
+                continue;
+            }
+            LiveTile& tile = liveTiles[std::make_pair(output.column, output.row)];
+            tile.coverage = std::move(output.coverage);
+            tile.bitmap = CreateLiveBitmap(tile.coverage);
+            RefreshDocument(output.dirty);
+        }
+        if (currentLine && currentLine->GetColor() != liveColor) {
+            liveColor = currentLine->GetColor(); // Rainbow mode recolors the whole stroke
+            for (auto& tile : liveTiles) {
+                tile.second.bitmap = CreateLiveBitmap(tile.second.coverage);
+                RefreshDocument(CanvasTileCache::GetTileRect(tile.first.first, tile.first.second));
+            }
+        }
+        return finished;
+    }
+
+    wxBitmap CreateLiveBitmap(const std::vector<unsigned char>& coverage) const {
+        wxImage image(StrokePipeline::tileSize, StrokePipeline::tileSize, false);
+        unsigned char* pixel = image.GetData();
+        for (size_t i = 0; i < coverage.size(); ++i, pixel += 3) {
+            pixel[0] = liveColor.Red();
+            pixel[1] = liveColor.Green();
+            pixel[2] = liveColor.Blue();
+        }
+        image.InitAlpha();
+        std::copy(coverage.begin(), coverage.end(), image.GetAlpha());
+        return wxBitmap(image);
+    }
+
+    // End the stroke at position and wait for the worker's last points; usually a few segments behind
+    std::vector<wxPoint> FinishStroke(const wxPoint& position) {
+        strokes.End(position);
+        return AwaitStroke();
+    }
+
+    // Wait for the worker to acknowledge the end of the stroke and take its live tiles off screen
+    std::vector<wxPoint> AwaitStroke() {
+        std::vector<wxPoint> points;
+        while (!PresentStroke(points)) {
+            std::this_thread::yield();
+        }
+        for (auto& tile : liveTiles) {
+            RefreshDocument(CanvasTileCache::GetTileRect(tile.first.first, tile.first.second));
+        }
+        liveTiles.clear();
+        return points;
+    }
+
+    // Drop a drag, stroke or polygon in progress
+    void CancelGestures() {
+        if (HasCapture()) {
+            ReleaseMouse();
+        }
+        selecting = false;
+        if (currentLine) {
+            strokes.Cancel();
+            AwaitStroke();
+        }
+        delete currentLine;
+        currentLine = nullptr;
+        delete previewShape;
+        previewShape = nullptr;
+        polygonPoints.clear();
+    }
+
+    void SetShapeTool(ShapeTool tool) {
+        if (tool != shapeTool && !polygonPoints.empty()) {
+            FinishPolygon(); // Keep a polygon that was in progress
+        }
+        if (tool != TOOL_SELECT) {
+            SetSelection(std::vector<Shape*>());
+        }
+        shapeTool = tool;
+    }
+};
+
+// Thumbnails of the drawings in a folder, generated in parallel on the worker pool
+class GalleryFrame : public wxFrame {
+private:
+    struct Item {
+        wxString path;
+        wxBitmap bitmap;
+        wxString status;
+    };
+
+    enum { cellWidth = 160, cellHeight = 180, thumbnailPixels = 128 };
+
+    wxScrolledWindow* view;
+    std::vector<Item> items;
+    std::function<void(const wxString&)> onOpen;
+    wxString title;
+    wxStopWatch watch;
+    int remaining = 0;
+    std::shared_ptr<char> alive = std::make_shared<char>(); // Expires with the frame, guards finished jobs
+
+public:
+    GalleryFrame(wxWindow* parent, const wxString& folder, std::function<void(const wxString&)> onOpen)
+        : wxFrame(parent, wxID_ANY, "Gallery", wxDefaultPosition, wxSize(700, 500)), onOpen(onOpen) {
+        title = "Gallery - " + folder;
+        SetTitle(title);
+        view = new wxScrolledWindow(this);
+        view->SetScrollRate(0, 20);
+        view->Bind(wxEVT_PAINT, &GalleryFrame::OnPaint, this);
+        view->Bind(wxEVT_SIZE, &GalleryFrame::OnSize, this);
+        view->Bind(wxEVT_LEFT_DCLICK, &GalleryFrame::OnDoubleClick, this);
+
+        wxArrayString files;
+        wxDir::GetAllFiles(folder, &files, "*.pnt", wxDIR_FILES);
+        files.Sort();
+        remaining = static_cast<int>(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            items.push_back(Item{ files[i], wxBitmap(), "Rendering..." });
+            std::weak_ptr<char> guard = alive;
+            wxString path = files[i];
+            GetWorkerPool().Submit([this, guard, path, i] {
+                std::shared_ptr<Thumbnail> thumbnail = std::make_shared<Thumbnail>();
+                bool ok = GenerateThumbnail(path, *thumbnail);
+                wxTheApp->CallAfter([this, guard, i, ok, thumbnail] {
+                    if (!guard.expired()) {
+                        ShowThumbnail(i, ok, *thumbnail);
+                    }
+                });
+            });
+        }
+    }
+
+private:
+    void ShowThumbnail(size_t index, bool ok, const Thumbnail& thumbnail) {
+        Item& item = items[index];
+        if (ok) {
+            item.bitmap = wxBitmap(thumbnail.GetLevel(thumbnailPixels).ToImage());
+            item.status = wxString::Format(thumbnail.incremental ? "+%d shapes, %ld ms" : "%d shapes, %ld ms",
+                                           thumbnail.drawnShapes, thumbnail.milliseconds);
+        }
+        else {
+            item.status = "Unreadable";
+        }
+        if (--remaining == 0) {
+            SetTitle(wxString::Format("%s (%d drawings in %ld ms)", title, static_cast<int>(items.size()), watch.Time()));
+        }
+        view->Refresh(false);
+    }
+
+    int GetColumns() const {
+        return std::max(1, view->GetClientSize().x / cellWidth);
+    }
+
+    void OnSize(wxSizeEvent& event) {
+        int rows = (static_cast<int>(items.size()) + GetColumns() - 1) / GetColumns();
+        view->SetVirtualSize(GetColumns() * cellWidth, rows * cellHeight);
+        view->Refresh(false);
+        event.Skip();
+    }
+
+    void OnPaint(wxPaintEvent&) {
+        wxPaintDC dc(view);
+        view->DoPrepareDC(dc);
+        dc.SetBackground(*wxWHITE_BRUSH);
+        dc.Clear();
+        int columns = GetColumns();
+        for (size_t i = 0; i < items.size(); ++i) {
+            const Item& item = items[i];
+            wxPoint cell(static_cast<int>(i % columns) * cellWidth, static_cast<int>(i / columns) * cellHeight);
+            if (item.bitmap.IsOk()) {
+                dc.DrawBitmap(item.bitmap, cell.x + (cellWidth - item.bitmap.GetWidth()) / 2,
+                              cell.y + 8 + (thumbnailPixels - item.bitmap.GetHeight()) / 2);
+            }
+            dc.DrawText(wxFileName(item.path).GetFullName(), cell.x + 8, cell.y + thumbnailPixels + 14);
+            dc.DrawText(item.status, cell.x + 8, cell.y + thumbnailPixels + 30);
+        }
+    }
+
+    void OnDoubleClick(wxMouseEvent& event) {
+        wxPoint at = view->CalcUnscrolledPosition(event.GetPosition());
+        size_t index = static_cast<size_t>(at.y / cellHeight * GetColumns() + at.x / cellWidth);
+        if (at.x / cellWidth < GetColumns() && index < items.size()) {
+            onOpen(items[index].path);
+        }
+    }
+};
+
+const unsigned int sessionMagic = 0x53534e50; // "PNSS"
+const int sessionVersion = 1;
+
+// Open documents as notebook pages; they all share the process-wide pen, brush, glyph and image
+// caches and the worker pool, and only per-document state lives in each canvas
+class DocumentTabs : public wxNotebook {
+private:
+    struct SessionDocument {
+        wxString path;
+        PaintCanvas::ViewState view;
+    };
+
+    std::vector<PaintCanvas*> recent; // Most recently shown first
+    std::map<PaintCanvas*, SessionDocument> pendingOpens; // Restored tabs whose documents load after the first frame
+    bool batchedRendering = false; // Backend for every open document, and new ones
+    HeatmapMode heatmapMode = HEATMAP_NONE;
+    int strokeCacheId = 0; // Resident stroke points, shed through every open document
+    enum { hiddenCacheBudget = 64 * 1024 * 1024 }; // Backbuffer bytes kept for documents off screen
+
+public:
+    DocumentTabs(wxWindow* parent) : wxNotebook(parent, wxID_ANY) {
+        Bind(wxEVT_NOTEBOOK_PAGE_CHANGED, [this](wxBookCtrlEvent& event) {
+            LoadPending(GetCanvas()); // A restored tab is needed now rather than in turn
+            UpdateVisibility();
+            event.Skip();
+        });
+        NewDocument();
+        strokeCacheId = GetCacheRegistry().Register("Stroke points", CacheRegistry::PRIORITY_STROKES,
+                                                    [] { return GetPointPager().GetResidentBytes(); },
+                                                    [this](size_t bytes) { return ShedStrokes(bytes); });
+        GetIdleScheduler().Start([this] { return GetCacheRegistry().Check() || GetCanvas()->DoIdleWork(); });
+    }
+
+    ~DocumentTabs() {
+        GetIdleScheduler().Stop();
+        GetCacheRegistry().Unregister(strokeCacheId);
+    }
+
+    PaintCanvas* GetCanvas() const {
+        return static_cast<PaintCanvas*>(GetCurrentPage());
+    }
+
+    PaintCanvas* NewDocument() {
+        PaintCanvas* canvas = new PaintCanvas(this);
+        canvas->SetBatchedRendering(batchedRendering);
+        canvas->SetHeatmapMode(heatmapMode);
+        AddPage(canvas, canvas->GetTitle(), true);
+        UpdateVisibility();
+        return canvas;
+    }
+
+    // Show the document if it is already open, otherwise open it in the untouched page or a new one
+    void OpenDocument(const wxString& path) {
+        for (size_t i = 0; i < GetPageCount(); ++i) {
+            PaintCanvas* canvas = static_cast<PaintCanvas*>(GetPage(i));
+            auto pending = pendingOpens.find(canvas);
+            if (canvas->GetPath() == path || (pending != pendingOpens.end() && pending->second.path == path)) {
+                SetSelection(i);
+                return;
+            }
+        }
+        PaintCanvas* canvas = GetCanvas();
+        bool reuse = canvas && canvas->IsUntouched();
+        if (!reuse) {
+            canvas = NewDocument();
+        }
+        if (!canvas->OpenDocument(path)) {
+            wxMessageBox("Could not read " + path, "Open Drawing", wxOK | wxICON_INFORMATION, this);
+            if (!reuse) {
+                CloseDocument();
+            }
+            return;
+        }
+        SetPageText(FindPage(canvas), canvas->GetTitle());
+    }
+
+    void Open() {
+        wxFileDialog dialog(this, "Open Drawing", "", "", "Drawings (*.pnt)|*.pnt", wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+        if (dialog.ShowModal() == wxID_OK) {
+            OpenDocument(dialog.GetPath());
+        }
+    }
+
+    void Save() {
+        GetCanvas()->Save();
+        SetPageText(GetSelection(), GetCanvas()->GetTitle());
+    }
+
+    void SaveAs() {
+        GetCanvas()->SaveAs();
+        SetPageText(GetSelection(), GetCanvas()->GetTitle());
+    }
+
+    void SetBatchedRendering(bool enabled) {
+        batchedRendering = enabled;
+        for (size_t i = 0; i < GetPageCount(); ++i) {
+            static_cast<PaintCanvas*>(GetPage(i))->SetBatchedRendering(enabled);
+        }
+    }
+
+    void SetHeatmapMode(HeatmapMode mode) {
+        heatmapMode = mode;
+        for (size_t i = 0; i < GetPageCount(); ++i) {
+            static_cast<PaintCanvas*>(GetPage(i))->SetHeatmapMode(mode);
+        }
+    }
+
+    void CloseDocument() {
+        PaintCanvas* canvas = GetCanvas();
+        if (canvas->IsModified() && wxMessageBox("Discard unsaved changes to " + canvas->GetTitle() + "?", "Close Drawing",
+                                                 wxYES_NO | wxICON_QUESTION, this) != wxYES) {
+            return;
+        }
+        recent.erase(std::remove(recent.begin(), recent.end(), canvas), recent.end());
+        pendingOpens.erase(canvas);
+        DeletePage(GetSelection());
+        if (GetPageCount() == 0) {
+            NewDocument();
+        }
+        UpdateVisibility();
+    }
+
+    // Saved documents open at exit, in tab order with the shown one marked, and how each was viewed.
+    // Unsaved documents are not kept
+    void SaveSession() const {
+        ShapeWriter out;
+        out.WriteInt(sessionMagic);
+        out.WriteInt(sessionVersion);
+        std::vector<SessionDocument> documents;
+        wxString shown;
+        for (size_t i = 0; i < GetPageCount(); ++i) {
+            PaintCanvas* canvas = static_cast<PaintCanvas*>(GetPage(i));
+            auto pending = pendingOpens.find(canvas);
+            SessionDocument document = pending != pendingOpens.end() ? pending->second : SessionDocument{ canvas->GetPath(), canvas->GetViewState() };
+            if (!document.path.IsEmpty()) {
+                documents.push_back(document);
+                if (canvas == GetCanvas()) {
+                    shown = document.path;
+                }
+            }
+        }
+        out.WriteString(shown);
+        out.WriteInt(static_cast<int>(documents.size()));
+        for (const SessionDocument& document : documents) {
+            out.WriteString(document.path);
+            out.WritePoint(document.view.scroll);
+            out.WriteInt(document.view.tool);
+            out.WriteColor(document.view.color);
+            out.WriteByte(document.view.rainbow);
+            out.WriteByte(document.view.eraser);
+        }
+        wxString path = GetSessionPath();
+        wxFileName::Mkdir(wxFileName(path).GetPath(), 0777, wxPATH_MKDIR_FULL);
+        wxString temp = path + ".tmp";
+        {
+            std::ofstream file(temp.fn_str(), std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(out.bytes.data()), out.bytes.size());
+            if (!file) {
+                return;
+            }
+        }
+        wxRenameFile(temp, path, true);
+    }
+
+    // Reopen the last session's documents. Only the one that was shown loads before the first frame;
+    // the other tabs are created with their names and load one per event turn after it
+    void RestoreSession() {
+        std::vector<unsigned char> bytes;
+        if (!ReadFileBytes(GetSessionPath(), bytes)) {
+            GetStartupTiming().restored = GetStartupTiming().clock.Time();
+            return;
+        }
+        ShapeReader in(bytes.data(), bytes.size());
+        std::vector<SessionDocument> documents;
+        wxString shown;
+        if (static_cast<unsigned int>(in.ReadInt()) == sessionMagic && in.ReadInt() == sessionVersion) {
+            shown = in.ReadString();
+            int count = in.ReadInt();
+            for (int i = 0; i < count && in.IsOk(); ++i) {
+                SessionDocument document;
+                document.path = in.ReadString();
+                document.view.scroll = in.ReadPoint();
+                int tool = in.ReadInt();
+                document.view.tool = tool >= TOOL_NONE && tool <= TOOL_SELECT ? static_cast<ShapeTool>(tool) : TOOL_NONE;
+                document.view.color = in.ReadColor();
+                document.view.rainbow = in.ReadByte() != 0;
+                document.view.eraser = in.ReadByte() != 0;
+                if (in.IsOk() && wxFileExists(document.path)) {
+                    documents.push_back(document);
+                }
+            }
+        }
+        PaintCanvas* shownCanvas = nullptr;
+        for (const SessionDocument& document : documents) {
+            PaintCanvas* canvas = GetCanvas();
+            if (!canvas->IsUntouched() || pendingOpens.count(canvas)) {
+                canvas = NewDocument();
+            }
+            pendingOpens[canvas] = document;
+            SetPageText(FindPage(canvas), wxFileName(document.path).GetFullName());
+            if (document.path == shown || !shownCanvas) {
+                shownCanvas = canvas;
+            }
+        }
+        if (shownCanvas) {
+            SetSelection(FindPage(shownCanvas));
+            LoadPending(shownCanvas);
+            UpdateVisibility();
+        }
+        LoadNextPending();
+    }
+
+private:
+    static wxString GetSessionPath() {
+        return wxFileName(wxStandardPaths::Get().GetUserDataDir(), "session").GetFullPath();
+    }
+
+    // Open a restored tab's document now, if it is still waiting
+    void LoadPending(PaintCanvas* canvas) {
+        auto pending = pendingOpens.find(canvas);
+        if (pending == pendingOpens.end()) {
+            return;
+        }
+        SessionDocument document = pending->second;
+        pendingOpens.erase(pending);
+        if (canvas->OpenDocument(document.path)) {
+            canvas->SetViewState(document.view);
+            SetPageText(FindPage(canvas), canvas->GetTitle());
+        }
+    }
+
+    void LoadNextPending() {
+        if (pendingOpens.empty()) {
+            if (GetStartupTiming().restored < 0) {
+                GetStartupTiming().restored = GetStartupTiming().clock.Time();
+            }
+            return;
+        }
+        CallAfter([this] {
+            for (size_t i = 0; i < GetPageCount(); ++i) {
+                PaintCanvas* canvas = static_cast<PaintCanvas*>(GetPage(i));
+                if (pendingOpens.count(canvas)) {
+                    LoadPending(canvas); // In tab order
+                    break;
+                }
+            }
+            LoadNextPending();
+        });
+    }
+
+    // Page out cold strokes in every document, a slice each; returns the bytes freed so far
+    size_t ShedStrokes(size_t bytes) {
+        PointPager& pager = GetPointPager();
+        size_t before = pager.GetResidentBytes();
+        for (size_t i = 0; i < GetPageCount(); ++i) {
+            static_cast<PaintCanvas*>(GetPage(i))->EvictColdStrokes(before - std::min(before, bytes));
+        }
+        return before - pager.GetResidentBytes();
+    }
+
+    // Mark which document is on screen and drop the backbuffers of hidden ones beyond the budget
+    void UpdateVisibility() {
+        PaintCanvas* shown = GetCanvas();
+        if (!shown) {
+            return;
+        }
+        GetIdleScheduler().Poke(); // Upkeep follows the visible document
+        recent.erase(std::remove(recent.begin(), recent.end(), shown), recent.end());
+        recent.insert(recent.begin(), shown);
+        size_t kept = 0;
+        for (PaintCanvas* canvas : recent) {
+            canvas->SetDocumentVisible(canvas == shown);
+            if (canvas != shown) {
+                kept += canvas->GetCacheBytes();
+                if (kept > hiddenCacheBudget) {
+                    kept -= canvas->GetCacheBytes();
+                    canvas->ReleaseCache();
+                }
+            }
+        }
+    }
+};
+
+// Application class
+class MyApp : public wxApp {
+public:
+    virtual bool OnInit();
+    virtual int OnExit();
+};
+
+// Custom IDs for color, shape, and modes
+const int ID_COLOR_RED = wxID_HIGHEST + 1;
+const int ID_COLOR_GREEN = wxID_HIGHEST + 2;
+const int ID_COLOR_BLUE = wxID_HIGHEST + 3;
+const int ID_MODE_RAINBOW = wxID_HIGHEST + 4;
+const int ID_MODE_ERASER = wxID_HIGHEST + 5;
+const int ID_MODE_CIRCLE = wxID_HIGHEST + 6;
+const int ID_MODE_SQUARE = wxID_HIGHEST + 7; // New menu ID for square mode
+const int ID_MODE_ELLIPSE = wxID_HIGHEST + 8;
+const int ID_MODE_LINE = wxID_HIGHEST + 9;
+const int ID_MODE_RECTANGLE = wxID_HIGHEST + 10;
+const int ID_MODE_POLYGON = wxID_HIGHEST + 11;
+const int ID_DEBUG_BENCHMARK = wxID_HIGHEST + 12;
+const int ID_MODE_TEXT = wxID_HIGHEST + 13;
+const int ID_DEBUG_GLYPH_STATS = wxID_HIGHEST + 14;
+const int ID_FILE_IMPORT_IMAGE = wxID_HIGHEST + 15;
+const int ID_EDIT_UNDO = wxID_HIGHEST + 16;
+const int ID_EDIT_REDO = wxID_HIGHEST + 17;
+const int ID_DEBUG_HISTORY = wxID_HIGHEST + 18;
+const int ID_MODE_SELECT = wxID_HIGHEST + 19;
+const int ID_EDIT_COPY = wxID_HIGHEST + 20;
+const int ID_EDIT_PASTE = wxID_HIGHEST + 21;
+const int ID_FILE_OPEN = wxID_HIGHEST + 22;
+const int ID_FILE_SAVE = wxID_HIGHEST + 23;
+const int ID_FILE_SAVE_AS = wxID_HIGHEST + 24;
+const int ID_FILE_GALLERY = wxID_HIGHEST + 25;
+const int ID_FILE_NEW = wxID_HIGHEST + 26;
+const int ID_FILE_CLOSE = wxID_HIGHEST + 27;
+const int ID_DEBUG_IDLE = wxID_HIGHEST + 28;
+const int ID_DEBUG_RECORD_PAN = wxID_HIGHEST + 29;
+const int ID_DEBUG_REPLAY_PAN = wxID_HIGHEST + 30;
+const int ID_DEBUG_TILE_COST = wxID_HIGHEST + 31;
+const int ID_DEBUG_BATCHED_PATHS = wxID_HIGHEST + 32;
+const int ID_DEBUG_BACKEND_BENCHMARK = wxID_HIGHEST + 33;
+const int ID_DEBUG_OVERDRAW = wxID_HIGHEST + 34;
+const int ID_DEBUG_COST = wxID_HIGHEST + 35;
+const int ID_DEBUG_LAYOUT = wxID_HIGHEST + 36;
+const int ID_DEBUG_INDEX = wxID_HIGHEST + 37;
+const int ID_DEBUG_BATCH = wxID_HIGHEST + 38;
+const int ID_DEBUG_STROKE_SHARING = wxID_HIGHEST + 39;
+const int ID_DEBUG_STARTUP = wxID_HIGHEST + 40;
+const int ID_DEBUG_LOADING = wxID_HIGHEST + 41;
+const int ID_DEBUG_PAGING = wxID_HIGHEST + 42;
+const int ID_DEBUG_CACHES = wxID_HIGHEST + 43;
+
+wxIMPLEMENT_APP(MyApp);
+
+bool MyApp::OnInit() {
+    GetStartupTiming().clock.Start();
+    wxFrame* frame = new wxFrame(nullptr, wxID_ANY, "Interactive Paint App", wxDefaultPosition, wxSize(800, 600));
+    DocumentTabs* tabs = new DocumentTabs(frame);
+    wxInitAllImageHandlers();
+
+    wxMenuBar* menuBar = new wxMenuBar;
+
+    // File menu
+    wxMenu* fileMenu = new wxMenu;
+    fileMenu->Append(ID_FILE_NEW, "New\tCtrl+N");
+    fileMenu->Append(ID_FILE_OPEN, "Open...\tCtrl+O");
+    fileMenu->Append(ID_FILE_SAVE, "Save\tCtrl+S");
+    fileMenu->Append(ID_FILE_SAVE_AS, "Save As...");
+    fileMenu->Append(ID_FILE_IMPORT_IMAGE, "Import Image...");
+    fileMenu->Append(ID_FILE_GALLERY, "Gallery...");
+    fileMenu->Append(ID_FILE_CLOSE, "Close\tCtrl+W");
+    menuBar->Append(fileMenu, "File");
+
+    // Edit menu
+    wxMenu* editMenu = new wxMenu;
+    editMenu->Append(ID_EDIT_UNDO, "Undo\tCtrl+Z");
+    editMenu->Append(ID_EDIT_REDO, "Redo\tCtrl+Y");
+    editMenu->Append(ID_EDIT_COPY, "Copy\tCtrl+C");
+    editMenu->Append(ID_EDIT_PASTE, "Paste\tCtrl+V");
+    menuBar->Append(editMenu, "Edit");
+
+    // Color menu
+    wxMenu* colorMenu = new wxMenu;
+    colorMenu->Append(ID_COLOR_RED, "Red");
+    colorMenu->Append(ID_COLOR_GREEN, "Green");
+    colorMenu->Append(ID_COLOR_BLUE, "Blue");
+    menuBar->Append(colorMenu, "Colors");
+
+    // Fun modes menu
+    wxMenu* modeMenu = new wxMenu;
+    modeMenu->Append(ID_MODE_RAINBOW, "Rainbow Brush");
+    modeMenu->Append(ID_MODE_ERASER, "Eraser");
+    modeMenu->Append(ID_MODE_CIRCLE, "Draw Circle");
+    modeMenu->Append(ID_MODE_SQUARE, "Draw Square");  // New menu option for square mode
+    modeMenu->Append(ID_MODE_ELLIPSE, "Draw Ellipse");
+    modeMenu->Append(ID_MODE_LINE, "Draw Line");
+    modeMenu->Append(ID_MODE_RECTANGLE, "Draw Rectangle");
+    modeMenu->Append(ID_MODE_POLYGON, "Draw Polygon");
+    modeMenu->Append(ID_MODE_TEXT, "Add Text");
+    modeMenu->Append(ID_MODE_SELECT, "Select");
+    menuBar->Append(modeMenu, "Fun Modes");
+
+    // Debug menu
+    wxMenu* debugMenu = new wxMenu;
+    debugMenu->Append(ID_DEBUG_BENCHMARK, "Render Benchmark");
+    debugMenu->Append(ID_DEBUG_GLYPH_STATS, "Glyph Cache Stats");
+    debugMenu->Append(ID_DEBUG_HISTORY, "History Memory");
+    debugMenu->Append(ID_DEBUG_IDLE, "Idle Activity");
+    debugMenu->AppendCheckItem(ID_DEBUG_RECORD_PAN, "Record Pan Trace");
+    debugMenu->Append(ID_DEBUG_REPLAY_PAN, "Replay Pan Trace");
+    debugMenu->Append(ID_DEBUG_TILE_COST, "Tile Render Cost");
+    debugMenu->AppendCheckItem(ID_DEBUG_BATCHED_PATHS, "Batched Path Rendering");
+    debugMenu->Append(ID_DEBUG_BACKEND_BENCHMARK, "Backend Benchmark");
+    debugMenu->AppendCheckItem(ID_DEBUG_OVERDRAW, "Overdraw Heatmap");
+    debugMenu->AppendCheckItem(ID_DEBUG_COST, "Cost Heatmap");
+    debugMenu->Append(ID_DEBUG_LAYOUT, "Layout Benchmark");
+    debugMenu->Append(ID_DEBUG_INDEX, "Index Benchmark");
+    debugMenu->Append(ID_DEBUG_BATCH, "Batch Insert Benchmark");
+    debugMenu->Append(ID_DEBUG_STROKE_SHARING, "Stroke Sharing");
+    debugMenu->Append(ID_DEBUG_STARTUP, "Startup Timing");
+    debugMenu->Append(ID_DEBUG_LOADING, "Load Timing");
+    debugMenu->Append(ID_DEBUG_PAGING, "Stroke Paging...");
+    debugMenu->Append(ID_DEBUG_CACHES, "Cache Memory...");
+    menuBar->Append(debugMenu, "Debug");
+
+    frame->SetMenuBar(menuBar);
+
+    // Bind file events
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->NewDocument(); }, ID_FILE_NEW);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->Open(); }, ID_FILE_OPEN);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->Save(); }, ID_FILE_SAVE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->SaveAs(); }, ID_FILE_SAVE_AS);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->CloseDocument(); }, ID_FILE_CLOSE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->ImportImage(); }, ID_FILE_IMPORT_IMAGE);
+    frame->Bind(wxEVT_MENU, [tabs, frame](wxCommandEvent&) {
+        wxDirDialog dialog(frame, "Gallery Folder", "", wxDD_DEFAULT_STYLE | wxDD_DIR_MUST_EXIST);
+        if (dialog.ShowModal() == wxID_OK) {
+            GalleryFrame* gallery = new GalleryFrame(frame, dialog.GetPath(), [tabs](const wxString& path) {
+                tabs->OpenDocument(path);
+            });
+            gallery->Show();
+        }
+    }, ID_FILE_GALLERY);
+
+    // Bind edit events
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->Undo(); }, ID_EDIT_UNDO);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->Redo(); }, ID_EDIT_REDO);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->CopySelection(); }, ID_EDIT_COPY);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->Paste(); }, ID_EDIT_PASTE);
+
+    // Bind color selection events
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->SetColor(*wxRED); }, ID_COLOR_RED);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->SetColor(*wxGREEN); }, ID_COLOR_GREEN);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->SetColor(*wxBLUE); }, ID_COLOR_BLUE);
+
+    // Bind mode selection events
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableRainbowMode(); }, ID_MODE_RAINBOW);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableEraserMode(); }, ID_MODE_ERASER);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableCircleMode(); }, ID_MODE_CIRCLE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableSquareMode(); }, ID_MODE_SQUARE);  // Square mode binding
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_ELLIPSE); }, ID_MODE_ELLIPSE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_LINE); }, ID_MODE_LINE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_RECTANGLE); }, ID_MODE_RECTANGLE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_POLYGON); }, ID_MODE_POLYGON);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_TEXT); }, ID_MODE_TEXT);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->EnableShapeMode(TOOL_SELECT); }, ID_MODE_SELECT);
+
+    // Bind debug events
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->RunRenderBenchmark(); }, ID_DEBUG_BENCHMARK);
+    frame->Bind(wxEVT_MENU, [frame](wxCommandEvent&) {
+        wxMessageBox(GetGlyphCache().Describe(), "Glyph Cache Stats", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_GLYPH_STATS);
+    frame->Bind(wxEVT_MENU, [tabs, frame](wxCommandEvent&) {
+        wxMessageBox(tabs->GetCanvas()->DescribeHistory(), "History Memory", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_HISTORY);
+    frame->Bind(wxEVT_MENU, [frame](wxCommandEvent&) {
+        wxMessageBox(GetIdleScheduler().Describe(), "Idle Activity", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_IDLE);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent& event) {
+        if (event.IsChecked()) {
+            tabs->GetCanvas()->StartPanRecording();
+        }
+        else {
+            tabs->GetCanvas()->StopPanRecording();
+        }
+    }, ID_DEBUG_RECORD_PAN);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->ReplayPanTrace(); }, ID_DEBUG_REPLAY_PAN);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->ReportTileRenderCost(); }, ID_DEBUG_TILE_COST);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent& event) { tabs->SetBatchedRendering(event.IsChecked()); }, ID_DEBUG_BATCHED_PATHS);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->RunBackendBenchmark(); }, ID_DEBUG_BACKEND_BENCHMARK);
+    frame->Bind(wxEVT_MENU, [tabs, menuBar](wxCommandEvent& event) {
+        // The two heatmaps share the tiles, so checking one unchecks the other
+        bool overdraw = event.GetId() == ID_DEBUG_OVERDRAW;
+        menuBar->Check(overdraw ? ID_DEBUG_COST : ID_DEBUG_OVERDRAW, false);
+        tabs->SetHeatmapMode(!event.IsChecked() ? HEATMAP_NONE : overdraw ? HEATMAP_OVERDRAW : HEATMAP_COST);
+    }, ID_DEBUG_OVERDRAW, ID_DEBUG_COST);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->RunLayoutBenchmark(); }, ID_DEBUG_LAYOUT);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->RunIndexBenchmark(); }, ID_DEBUG_INDEX);
+    frame->Bind(wxEVT_MENU, [tabs](wxCommandEvent&) { tabs->GetCanvas()->RunBatchBenchmark(); }, ID_DEBUG_BATCH);
+    frame->Bind(wxEVT_MENU, [tabs, frame](wxCommandEvent&) {
+        wxMessageBox(tabs->GetCanvas()->DescribeStrokeSharing(), "Stroke Sharing", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_STROKE_SHARING);
+    frame->Bind(wxEVT_MENU, [frame](wxCommandEvent&) {
+        wxMessageBox(GetStartupTiming().Describe(), "Startup Timing", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_STARTUP);
+    frame->Bind(wxEVT_MENU, [tabs, frame](wxCommandEvent&) {
+        wxMessageBox(tabs->GetCanvas()->DescribeLoading(), "Load Timing", wxOK | wxICON_INFORMATION, frame);
+    }, ID_DEBUG_LOADING);
+    frame->Bind(wxEVT_MENU, [frame](wxCommandEvent&) {
+        PointPager& pager = GetPointPager();
+        wxString budget = wxGetTextFromUser(pager.Describe() + "\n\nResident budget in MB:", "Stroke Paging",
+                                            wxString::Format("%zu", pager.budget / (1024 * 1024)), frame);
+        unsigned long megabytes;
+        if (budget.ToULong(&megabytes)) {
+            pager.budget = static_cast<size_t>(megabytes) * 1024 * 1024;
+            GetIdleScheduler().Poke();
+        }
+    }, ID_DEBUG_PAGING);
+    frame->Bind(wxEVT_MENU, [frame](wxCommandEvent&) {
+        CacheRegistry& registry = GetCacheRegistry();
+        wxString ceiling = wxGetTextFromUser(registry.Describe() + "\n\nCeiling in MB:", "Cache Memory",
+                                             wxString::Format("%zu", registry.ceiling / (1024 * 1024)), frame);
+        unsigned long megabytes;
+        if (ceiling.ToULong(&megabytes)) {
+            registry.ceiling = static_cast<size_t>(megabytes) * 1024 * 1024;
+            GetIdleScheduler().Poke();
+        }
+    }, ID_DEBUG_CACHES);
+
+    // Documents reopen as they were left
+    frame->Bind(wxEVT_CLOSE_WINDOW, [tabs](wxCloseEvent& event) {
+        tabs->SaveSession();
+        event.Skip();
+    });
+    tabs->RestoreSession();
+
+    frame->Show();
+    return true;
+}
+
+int MyApp::OnExit() {
+    GetWorkerPool().Shutdown();
+    GetGlyphCache().Clear();
+    GetImageTileCache().Clear();
+    GetShapeClipboard().shapes.clear();
+    return wxApp::OnExit();
+}